@@ -11,9 +11,9 @@ TEST_FILE_NAME = "test"; # The name of the assembly file to assemble and run
 RESULT_FILE_NAME = "expect_results"; # The name of the json file with the expect results, fail if they don't match
 LINKER_SCRIPT = "linker.ld";
 
+# brv loads the linked ELF (linked.bin) directly, no objcopy step is needed
 #build_command = "clang --target=" + ARCHITECTURE + " -march=" + SUBSET + " " + TEST_FILE_NAME + ".s -c -o obj.o -nostdlib"; # Compile to object file
 #link_command  = "riscv32-elf-ld --script=" + LINKER_SCRIPT + "obj.o -o linked.bin"; # Link it
-#strip_command = "riscv32-elf-objcopy -O binary linked.bin " + TEST_FILE_NAME + ".stripped"; # Strip out everything but the actual instructions
 
 def main():
     num_args = len(sys.argv);
@@ -41,15 +41,6 @@ def main():
             sys.argv[1] + "linked.bin"
         ]
     );
-    strip_output = subprocess.run(
-        [
-            "riscv32-elf-objcopy",
-            "-O",
-            "binary",
-            sys.argv[1] + "linked.bin",
-            sys.argv[1] + TEST_FILE_NAME + ".stripped"
-        ]
-    );
 
 
 if __name__ == "__main__":
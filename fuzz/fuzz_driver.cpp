@@ -0,0 +1,79 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fmt/core.h>
+
+// Runs a fuzz target without libFuzzer, for compilers that don't have it
+// and for measuring how fast the target goes:
+//
+//   brv-fuzz-run FILE...                       each file as one input
+//   brv-fuzz-run [--seconds=N] [--size=BYTES] [--seed=N]
+//
+// Without files it feeds the target random inputs of --size bytes for
+// --seconds and prints how many it ran a second.
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+int main(int argc, char* argv[])
+{
+    double seconds = 5;
+    std::size_t size = 256;
+    uint64_t seed = 1;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.rfind("--seconds=", 0) == 0)
+            seconds = std::stod(arg.substr(10));
+        else if (arg.rfind("--size=", 0) == 0)
+            size = std::stoul(arg.substr(7));
+        else if (arg.rfind("--seed=", 0) == 0)
+            seed = std::stoull(arg.substr(7));
+        else
+            files.push_back(arg);
+    }
+
+    for (const std::string& path : files)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+        {
+            fmt::print("Could not open {}\n", path);
+            return 1;
+        }
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+        fmt::print("Ran {} ({} bytes)\n", path, data.size());
+    }
+    if (!files.empty())
+        return 0;
+
+    std::mt19937_64 random(seed);
+    std::vector<uint8_t> data((size + 7) & ~(std::size_t)7);
+    uint64_t runs = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed{};
+    // Checking the clock every input would show up in the rate
+    while (elapsed.count() < seconds)
+    {
+        for (uint32_t i = 0; i < 256; i++, runs++)
+        {
+            for (std::size_t at = 0; at < data.size(); at += 8)
+            {
+                uint64_t bits = random();
+                std::memcpy(data.data() + at, &bits, 8);
+            }
+            LLVMFuzzerTestOneInput(data.data(), size);
+        }
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    fmt::print("{} inputs of {} bytes in {:.2f}s ({:.0f} a second)\n", runs, size, elapsed.count(), runs / elapsed.count());
+    return 0;
+}
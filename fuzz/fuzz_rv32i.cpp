@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <fmt/core.h>
+
+#include "machine.hpp"
+
+// libFuzzer target: every input is turned into a stream of RV32I
+// instructions, run from address 0 for at most FUZZ_BUDGET instructions.
+// The low 7 bits of each little endian word pick one of the RV32I major
+// opcodes and the rest of the word is left alone, so the fuzzer spends its
+// time on operands and funct fields rather than on opcodes nothing decodes.
+//
+// One machine serves every input. Between inputs it's cleared, which only
+// costs as much as the pages and code the last input touched.
+//
+// BRV_FUZZ_CORE=switch|threaded|block picks the core, switch by default.
+// Every input is new code, which the block core has to translate before it
+// runs it only once or twice, so it gets through far fewer inputs a second.
+// System calls can't reach the host: console output is thrown away and
+// anything but brk and exit fails.
+
+// Small, so most wild addresses fault instead of touching a new page
+const uint64_t FUZZ_MEMORY = 1 << 16;
+const uint64_t FUZZ_BUDGET = 1000;
+const uint32_t FUZZ_MAX_IMAGE = 1 << 14;
+
+static const uint8_t RV32I_OPCODES[] = {
+    0x37, // LUI
+    0x17, // AUIPC
+    0x6F, // JAL
+    0x67, // JALR
+    0x63, // BRANCH
+    0x03, // LOAD
+    0x23, // STORE
+    0x13, // OP-IMM
+    0x33, // OP
+    0x0F, // MISC-MEM
+    0x73, // SYSTEM
+};
+
+static core_kind fuzz_core()
+{
+    const char* name = std::getenv("BRV_FUZZ_CORE");
+    std::string core = name ? name : "switch";
+    if (core == "block")
+        return CORE_BLOCK;
+    if (core == "threaded")
+        return CORE_THREADED;
+    return CORE_SWITCH;
+}
+
+static machine& fuzz_machine()
+{
+    static machine vm(FUZZ_MEMORY, fuzz_core(), 1);
+    static bool ready = false;
+    if (!ready)
+    {
+        vm.syscalls().set_host_access(false);
+        ready = true;
+    }
+    return vm;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    static uint32_t image[FUZZ_MAX_IMAGE / 4];
+    uint32_t words = std::min<size_t>(size, FUZZ_MAX_IMAGE) / 4;
+    if (words == 0)
+        return 0;
+    for (uint32_t i = 0; i < words; i++)
+    {
+        uint32_t word;
+        std::memcpy(&word, data + i * 4, 4);
+        image[i] = (word & ~0x7Fu) | RV32I_OPCODES[(word & 0x7F) % sizeof(RV32I_OPCODES)];
+    }
+
+    machine& vm = fuzz_machine();
+    vm.clear();
+    vm.load(image, words * 4);
+    exit_reason reason = vm.run(FUZZ_BUDGET)[0];
+
+    // Whatever the program does, the core has to stop within the budget and
+    // for a reason hart::run hands out
+    const hart& h = vm.hart_at(0);
+    bool sane = h.instret() <= FUZZ_BUDGET && (reason != EXIT_LIMIT || h.instret() == FUZZ_BUDGET) &&
+                reason != EXIT_ECALL && reason != EXIT_INTERRUPTED;
+    if (!sane)
+    {
+        fmt::print(stderr, "Stopped with reason {} after {} instructions at pc {:08x}\n", (int)reason, h.instret(), h.pc());
+        std::abort();
+    }
+    return 0;
+}
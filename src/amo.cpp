@@ -0,0 +1,73 @@
+#include <atomic>
+#include <cstdint>
+
+#include "amo.hpp"
+
+// Atomic min/max have no host instruction, retry a compare-exchange instead
+template <typename T>
+static uint32_t fetch_select(std::atomic_ref<uint32_t> word, uint32_t src, bool keep_min)
+{
+    uint32_t old = word.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        bool src_smaller = (T)src < (T)old;
+        uint32_t value = (src_smaller == keep_min) ? src : old;
+        if (value == old || word.compare_exchange_weak(old, value, std::memory_order_seq_cst))
+            return old;
+    }
+}
+
+bool execute_amo(cpu_state& cpu, guest_memory& memory, const decoded_instr& d, uint32_t addr, uint32_t src, uint32_t& result)
+{
+    if ((addr & 3) != 0 || (uint64_t)addr + 4 > memory.size())
+        return false;
+
+    // An SC.W succeeds when neither the granule's version nor the reserved
+    // word's value has moved since the LR.W. SC.W and the AMOs bump the
+    // version, the AMOs before they write so an SC.W can't slip in after.
+    // Plain stores don't, every store would pay for it, so plain stores
+    // that change the word and then put the old value back go unnoticed
+    // (ABA). Compare-and-swap loops can't tell, but it's weaker than the
+    // spec's reservation, which any store to the granule breaks.
+    if (d.op != OP_LR_W && d.op != OP_SC_W)
+        memory.granule_version(addr).fetch_add(1, std::memory_order_acq_rel);
+
+    std::atomic_ref<uint32_t> word = memory.word(addr);
+    switch (d.op)
+    {
+        case OP_LR_W:
+            cpu.reserved_version = memory.granule_version(addr).load(std::memory_order_acquire);
+            cpu.reserved_value = word.load(std::memory_order_seq_cst);
+            cpu.reserved_addr = addr;
+            result = cpu.reserved_value;
+            break;
+        case OP_SC_W:
+            {
+                // Any SC.W gives up the reservation, successful or not
+                bool reserved = cpu.reserved_addr == addr;
+                cpu.reserved_addr = 1;
+                result = 1;
+                if (!reserved)
+                    break;
+
+                uint32_t version = cpu.reserved_version;
+                if (!memory.granule_version(addr).compare_exchange_strong(version, version + 1, std::memory_order_acq_rel))
+                    break;
+
+                uint32_t expected = cpu.reserved_value;
+                if (word.compare_exchange_strong(expected, src, std::memory_order_seq_cst))
+                    result = 0;
+            }
+            break;
+        case OP_AMOSWAP_W: result = word.exchange(src); break;
+        case OP_AMOADD_W:  result = word.fetch_add(src); break;
+        case OP_AMOXOR_W:  result = word.fetch_xor(src); break;
+        case OP_AMOAND_W:  result = word.fetch_and(src); break;
+        case OP_AMOOR_W:   result = word.fetch_or(src); break;
+        case OP_AMOMIN_W:  result = fetch_select<int32_t>(word, src, true); break;
+        case OP_AMOMAX_W:  result = fetch_select<int32_t>(word, src, false); break;
+        case OP_AMOMINU_W: result = fetch_select<uint32_t>(word, src, true); break;
+        case OP_AMOMAXU_W: result = fetch_select<uint32_t>(word, src, false); break;
+    }
+    return true;
+}
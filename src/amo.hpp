@@ -0,0 +1,25 @@
+#ifndef AMO_HPP
+#define AMO_HPP
+
+#include <cstdint>
+
+#include "cpu.hpp"
+#include "decode.hpp"
+#include "memory.hpp"
+
+// Execute LR.W, SC.W or an AMO*.W on the word at addr, with src = x[rs2].
+// result gets the value for rd. Returns false when addr is misaligned or
+// outside guest memory, in which case nothing was accessed.
+//
+// AMOs map onto host atomic read-modify-writes. SC.W claims its granule by
+// moving the granule version on from the one LR.W saw, then swaps the new
+// value in only if the word still holds what LR.W loaded.
+bool execute_amo(cpu_state& cpu, guest_memory& memory, const decoded_instr& d, uint32_t addr, uint32_t src, uint32_t& result);
+
+// True for the ops that may write memory
+inline bool amo_writes(uint8_t op)
+{
+    return op != OP_LR_W;
+}
+
+#endif
@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+
+#include <fmt/core.h>
+
+#include "batch.hpp"
+#include "machine.hpp"
+
+struct batch_job
+{
+    uint64_t index;
+    std::string path;
+    uint64_t budget;
+    std::string error; // Set if the line couldn't be used, the job isn't run
+};
+
+// Jobs read but not yet taken. Bounded, so a long stream is read no faster
+// than it's run.
+class batch_queue
+{
+public:
+    explicit batch_queue(std::size_t capacity) : capacity(capacity) {}
+
+    void push(batch_job job)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [this]() { return jobs.size() < capacity; });
+        jobs.push_back(std::move(job));
+        changed.notify_all();
+    }
+
+    // False once the input has ended and every job was taken
+    bool pop(batch_job& job)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [this]() { return !jobs.empty() || ended; });
+        if (jobs.empty())
+            return false;
+        job = std::move(jobs.front());
+        jobs.pop_front();
+        changed.notify_all();
+        return true;
+    }
+
+    void end()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        ended = true;
+        changed.notify_all();
+    }
+
+private:
+    std::size_t capacity;
+    std::deque<batch_job> jobs;
+    std::mutex lock;
+    std::condition_variable changed;
+    bool ended = false;
+};
+
+static const char* stop_name(exit_reason reason)
+{
+    switch (reason)
+    {
+        case EXIT_EBREAK: return "ebreak";
+        case EXIT_EXITED: return "exited";
+        case EXIT_FAULT:  return "fault";
+        case EXIT_LIMIT:  return "limit";
+        case EXIT_INTERRUPTED: return "timeout";
+        default:          return "error";
+    }
+}
+
+// A line is a path and an optional budget, split at the last space so
+// paths may have spaces in them. A budget that doesn't fit in 64 bits
+// leaves the job with an error.
+static bool parse_job(const char* line, batch_job& job)
+{
+    std::string text = line;
+    while (!text.empty() && (text.back() == '\n' || text.back() == '\r' || text.back() == ' ' || text.back() == '\t'))
+        text.pop_back();
+    std::size_t start = text.find_first_not_of(" \t");
+    if (start == std::string::npos || text[start] == '#')
+        return false;
+    text = text.substr(start);
+
+    job.budget = BATCH_BUDGET;
+    job.error.clear();
+    std::size_t split = text.find_last_of(" \t");
+    if (split != std::string::npos && text.find_first_not_of("0123456789", split + 1) == std::string::npos)
+    {
+        const char* digits = text.c_str() + split + 1;
+        if (std::from_chars(digits, text.c_str() + text.size(), job.budget).ec != std::errc())
+            job.error = fmt::format("Budget {} is out of range", digits);
+        text.resize(text.find_last_not_of(" \t", split) + 1);
+    }
+    job.path = text;
+    return true;
+}
+
+uint64_t run_batch(std::FILE* in, std::FILE* out, const batch_options& options)
+{
+    uint32_t worker_count = std::max(options.workers, 1u);
+    batch_queue queue(worker_count * 4);
+    std::mutex out_lock;
+    uint64_t failed = 0;
+
+    // Unless in is a file, something may be waiting on each record before
+    // it sends more
+    struct stat st;
+    bool streaming = fstat(fileno(in), &st) != 0 || !S_ISREG(st.st_mode);
+
+    auto worker = [&]()
+    {
+        machine vm(options.memory_size, options.core, options.hart_count);
+        vm.syscalls().set_host_access(false);
+        bool dirty = false;
+        batch_job job;
+        while (queue.pop(job))
+        {
+            auto start = std::chrono::steady_clock::now();
+            if (dirty)
+                vm.clear();
+            dirty = true;
+
+            exit_reason reason = EXIT_ECALL; // Stands for an error, run never returns it
+            std::string error = job.error;
+            if (error.empty() && vm.load(job.path.c_str(), error))
+                reason = vm.run(job.budget, options.timeout)[0];
+            const hart& h = vm.hart_at(0);
+            uint32_t a0 = reason == EXIT_EXITED ? (uint32_t)vm.syscalls().exit_code() : h.reg(10);
+            uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+            std::lock_guard<std::mutex> guard(out_lock);
+            fmt::print(out, "{}\t{}\t{}\t{}\t{}\t{}{}\n", job.index, stop_name(reason), (int32_t)a0, h.instret(), micros, job.path,
+                       reason == EXIT_ECALL ? "\t" + error : "");
+            if (streaming)
+                std::fflush(out);
+            if (reason != EXIT_EBREAK && reason != EXIT_EXITED)
+                failed++;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < worker_count; i++)
+        workers.emplace_back(worker);
+
+    char* line = nullptr;
+    std::size_t capacity = 0;
+    batch_job job;
+    uint64_t index = 0;
+    while (getline(&line, &capacity, in) != -1)
+    {
+        if (!parse_job(line, job))
+            continue;
+        job.index = index++;
+        queue.push(std::move(job));
+    }
+    std::free(line);
+    queue.end();
+
+    for (std::thread& w : workers)
+        w.join();
+    std::fflush(out);
+    return failed;
+}
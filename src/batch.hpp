@@ -0,0 +1,43 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+#include "core.hpp"
+
+// Default budget for a job whose line doesn't give one
+const uint64_t BATCH_BUDGET = 100000000;
+
+struct batch_options
+{
+    core_kind core = CORE_BLOCK;
+    uint32_t workers = 1;
+    uint32_t hart_count = 1;
+    uint64_t memory_size = 1ull << 32;
+    std::chrono::nanoseconds timeout{}; // Wall clock limit of each job, 0 for none
+};
+
+// Run the jobs listed in `in` on a pool of workers, each of which keeps one
+// machine and clears it between jobs rather than building another. A job
+// is a line holding an image path and optionally an instruction budget;
+// blank lines and ones starting with # are skipped. Jobs start as soon as
+// they're read, so in can be a pipe fed as results come back.
+//
+// Writes one tab separated record to out as each job finishes, in whatever
+// order they do:
+//
+//   job  stop  a0  instret  microseconds  path
+//
+// job counts from 0 in input order. stop is ebreak, exited, fault, limit,
+// timeout or error (the image couldn't be loaded or the budget read), and
+// an error record has the reason as one more field after the path. a0 is
+// the exit status for exited.
+//
+// Jobs have no access to the host: what they print is thrown away and
+// they can't open files, so nothing but records reaches out.
+// Returns how many jobs didn't stop at EBREAK or exit.
+uint64_t run_batch(std::FILE* in, std::FILE* out, const batch_options& options);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef BLOCK_HPP
+#define BLOCK_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "cpu.hpp"
+#include "decode.hpp"
+
+// pc of a block that has been invalidated, never a valid instruction address
+const uint32_t INVALID_PC = 1;
+
+// Longest straight-line run translated into a single block
+const uint32_t MAX_BLOCK_OPS = 64;
+
+// Executions after which a block is compiled to native code
+const uint32_t JIT_THRESHOLD = 50;
+
+const uint32_t FUSION_KINDS = OP_ADDI_BNE - OP_LUI_ADDI + 1;
+
+const char* const fusion_names[FUSION_KINDS] = { "LUI+ADDI", "AUIPC+ADDI", "AUIPC+JALR", "AUIPC+LW", "ADDI+BNE" };
+
+// Native code for a block. Returns the index of the first micro-op it did
+// not execute; ops.size() means the whole block ran and cpu->pc_reg holds
+// the next pc.
+using native_fn = uint32_t (*)(cpu_state* cpu, uint8_t* memory, const uint64_t* code_pages);
+
+// A basic block: a straight-line run of instructions ending in a branch,
+// JAL, JALR, ECALL, EBREAK or FENCE.I, or cut short at a page boundary / MAX_BLOCK_OPS
+// (those end in OP_BLOCK_END instead). Blocks never start an instruction on
+// a second guest page, though a final 32-bit one may straddle into it.
+//
+// Micro-ops are resolved against the block's address when translated:
+// AUIPC becomes LUI of the final value, and branch/JAL immediates hold the
+// absolute target. The fall-through / return address of the terminator is
+// always end_pc. Instructions whose only effect is writing x0 become OP_NOP.
+//
+// Common instruction pairs are fused: the first slot's op becomes a
+// superinstruction that executes both, and the second slot is left as it
+// was, so execution can still resume at either slot.
+struct block
+{
+    uint32_t pc;
+    uint32_t end_pc;
+    uint32_t count;                          // Guest instructions in the block
+    block* next[2] = { nullptr, nullptr };   // [0] fall-through successor, [1] taken/indirect successor
+    uint32_t exec_count = 0;
+    bool single_step = false;                // Holds one instruction, used to run up to an exact limit
+    native_fn native = nullptr;
+    std::vector<decoded_instr> ops;
+#ifdef BRV_STATS
+    std::vector<uint8_t> guest_ops;          // Op each slot was decoded as, before resolving and fusion
+#endif
+};
+
+// Op of the first instruction of a fused pair, as it was before fusion
+inline uint8_t unfused_op(uint8_t op)
+{
+    switch (op)
+    {
+        case OP_LUI_ADDI: case OP_AUIPC_ADDI: case OP_AUIPC_JALR: case OP_AUIPC_LW: return OP_LUI;
+        case OP_ADDI_BNE: return OP_ADDI;
+        default: return op;
+    }
+}
+
+#endif
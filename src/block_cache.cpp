@@ -0,0 +1,192 @@
+#include <cstdint>
+#include <vector>
+
+#include "block_cache.hpp"
+
+static bool is_terminator(uint8_t op)
+{
+    switch (op)
+    {
+        case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+        case OP_JAL: case OP_JALR:
+        case OP_ECALL: case OP_EBREAK:
+        case OP_FENCE_I:
+        case OP_FETCH_FAULT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Turn first into the superinstruction for (first, second) if there is one.
+// AUIPC has already been resolved to LUI, first_auipc says which it was.
+static bool fuse(decoded_instr& first, const decoded_instr& second, bool first_auipc)
+{
+    if (first.op == OP_LUI && second.rs1 == first.rd)
+    {
+        switch (second.op)
+        {
+            case OP_ADDI: first.op = first_auipc ? OP_AUIPC_ADDI : OP_LUI_ADDI; return true;
+            case OP_JALR: if (!first_auipc) return false; first.op = OP_AUIPC_JALR; return true;
+            case OP_LW:   if (!first_auipc || second.rd == 0) return false; first.op = OP_AUIPC_LW; return true;
+        }
+    }
+    if (first.op == OP_ADDI && second.op == OP_BNE && (second.rs1 == first.rd || second.rs2 == first.rd))
+    {
+        first.op = OP_ADDI_BNE;
+        return true;
+    }
+    return false;
+}
+
+block* block_cache::translate(uint32_t pc, uint32_t max_ops)
+{
+    std::unique_ptr<block> b = std::make_unique<block>();
+    b->pc = pc;
+    b->single_step = max_ops == 1;
+    b->ops.reserve(8);
+#ifdef BRV_STATS
+    b->guest_ops.reserve(8);
+#endif
+
+    bool prev_auipc = false; // ops.back() was an AUIPC
+    bool prev_free = false;  // ops.back() isn't already the second half of a pair
+    uint32_t at = pc;
+    uint32_t count = 0;
+    for (;;)
+    {
+        decoded_instr d = icache.fetch(at);
+        uint8_t guest_op = d.op;
+        bool auipc = guest_op == OP_AUIPC;
+        uint32_t ipc = at;
+        at += d.len;
+        count++;
+
+        switch (d.op)
+        {
+            case OP_AUIPC:
+                d.op = OP_LUI;
+                d.imm = ipc + d.imm;
+                break;
+            case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+            case OP_JAL:
+                d.imm = ipc + d.imm;
+                break;
+        }
+        // Results written to x0 are dropped here, so only the terminators
+        // have to keep x0 at zero at run time. Loads stay, they can fault,
+        // and put x0 back themselves.
+        if (d.rd == 0 && d.op >= OP_ADD && d.op <= OP_SLTIU)
+            d.op = OP_NOP;
+        if (d.rd == 0 && d.op == OP_LUI)
+            d.op = OP_NOP;
+#ifdef BRV_STATS
+        b->guest_ops.push_back(guest_op);
+#endif
+        b->ops.push_back(d);
+
+        std::size_t n = b->ops.size();
+        if (prev_free && fuse(b->ops[n - 2], b->ops[n - 1], prev_auipc))
+        {
+            fusion_sites[b->ops[n - 2].op - OP_LUI_ADDI]++;
+            prev_free = false;
+        }
+        else
+        {
+            prev_free = true;
+        }
+        prev_auipc = auipc;
+
+        if (is_terminator(d.op))
+            break;
+
+        if ((at >> 12) != (pc >> 12) || b->ops.size() == max_ops)
+        {
+            b->ops.push_back({ OP_BLOCK_END, 0, 0, 0, 0, 0 });
+#ifdef BRV_STATS
+            b->guest_ops.push_back(OP_BLOCK_END);
+#endif
+            break;
+        }
+    }
+
+    b->end_pc = at;
+    b->count = count;
+
+    // Only a 32-bit instruction straddling the boundary reaches the next page
+    block* raw = b.get();
+    page_blocks[pc >> 12].push_back(raw);
+    if (((at - 1) >> 12) != (pc >> 12))
+        page_blocks[(at - 1) >> 12].push_back(raw);
+    (raw->single_step ? steps : blocks).emplace(pc, std::move(b));
+    return raw;
+}
+
+void block_cache::invalidate(uint32_t addr, uint32_t len)
+{
+    for (uint32_t page = addr >> 12; page <= (addr + len - 1) >> 12; page++)
+    {
+        auto it = page_blocks.find(page);
+        if (it == page_blocks.end())
+            continue;
+
+        for (block* b : it->second)
+        {
+            // Already dropped through the other page it straddles
+            if (b->pc == INVALID_PC)
+                continue;
+            auto& map = b->single_step ? steps : blocks;
+            auto owner = map.find(b->pc);
+            retired.push_back(std::move(owner->second));
+            map.erase(owner);
+            b->pc = INVALID_PC;
+        }
+        page_blocks.erase(it);
+    }
+}
+
+void block_cache::collect()
+{
+    // Live blocks may still link to the blocks about to be freed
+    for (auto* map : { &blocks, &steps })
+    {
+        for (auto& [pc, b] : *map)
+        {
+            for (block*& n : b->next)
+                if (n && n->pc == INVALID_PC)
+                    n = nullptr;
+        }
+    }
+    for (auto& [page, list] : page_blocks)
+        std::erase_if(list, [](block* b) { return b->pc == INVALID_PC; });
+    retired.clear();
+}
+
+void block_cache::clear()
+{
+    blocks.clear();
+    steps.clear();
+    page_blocks.clear();
+    retired.clear();
+#ifdef BRV_JIT
+    jit.reset();
+#endif
+}
+
+#ifdef BRV_JIT
+void block_cache::compile_native(block* b)
+{
+    b->native = jit.compile(*b, memory.size());
+    if (b->native || !jit.available())
+        return;
+
+    for (auto& [pc, live] : blocks)
+        live->native = nullptr;
+    for (auto& [pc, live] : steps)
+        live->native = nullptr;
+    for (auto& dead : retired)
+        dead->native = nullptr;
+    jit.reset();
+    b->native = jit.compile(*b, memory.size());
+}
+#endif
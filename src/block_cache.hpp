@@ -0,0 +1,79 @@
+#ifndef BLOCK_CACHE_HPP
+#define BLOCK_CACHE_HPP
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "block.hpp"
+#include "decode_cache.hpp"
+#include "memory.hpp"
+
+#ifdef BRV_JIT
+#include "jit_x86_64.hpp"
+#endif
+
+class block_cache
+{
+public:
+    block_cache(decode_cache& icache, const guest_memory& memory) : icache(icache), memory(memory) {}
+
+    // Block starting at pc, translating it on first use
+    block* lookup(uint32_t pc)
+    {
+        auto it = blocks.find(pc);
+        if (it != blocks.end()) [[likely]]
+            return it->second.get();
+        return translate(pc, MAX_BLOCK_OPS);
+    }
+
+    // Block holding only the instruction at pc
+    block* lookup_step(uint32_t pc)
+    {
+        auto it = steps.find(pc);
+        if (it != steps.end())
+            return it->second.get();
+        return translate(pc, 1);
+    }
+
+    // Invalidate every block on the guest pages overlapping [addr, addr + len).
+    // Invalidated blocks keep their memory (their pc becomes INVALID_PC) so
+    // stale chain links and a block that is still executing stay safe.
+    void invalidate(uint32_t addr, uint32_t len);
+
+    // Free invalidated blocks. Only call when no block pointer is held
+    // outside the cache.
+    void collect();
+
+    // Drop every block and all native code. Only call when no block pointer
+    // is held outside the cache.
+    void clear();
+
+    bool has_garbage() const { return retired.size() >= 256; }
+
+    // Pairs fused at translation, and interpreted executions of them
+    uint64_t fusion_sites[FUSION_KINDS] = {};
+    uint64_t fusion_hits[FUSION_KINDS] = {};
+
+#ifdef BRV_JIT
+    // Compile a hot block to native code. When the code buffer fills up all
+    // native code is dropped and generation starts over.
+    void compile_native(block* b);
+#endif
+
+private:
+    block* translate(uint32_t pc, uint32_t max_ops);
+
+    decode_cache& icache;
+    const guest_memory& memory;
+    std::unordered_map<uint32_t, std::unique_ptr<block>> blocks;
+    std::unordered_map<uint32_t, std::unique_ptr<block>> steps;
+    std::unordered_map<uint32_t, std::vector<block*>> page_blocks;
+    std::vector<std::unique_ptr<block>> retired;
+#ifdef BRV_JIT
+    jit_x86_64 jit;
+#endif
+};
+
+#endif
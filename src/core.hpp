@@ -0,0 +1,47 @@
+#ifndef CORE_HPP
+#define CORE_HPP
+
+#include <cstdint>
+
+#include "cpu.hpp"
+#include "memory.hpp"
+#include "decode_cache.hpp"
+#include "block_cache.hpp"
+#include "trace.hpp"
+
+// Why an execution core handed control back to its caller
+enum exit_reason
+{
+    EXIT_EBREAK,
+    EXIT_FAULT, // Access outside guest memory, pc_reg is the faulting instruction
+    EXIT_LIMIT, // instret reached the limit, pc_reg is the next instruction
+    EXIT_ECALL, // System call, pc_reg is the instruction after the ECALL
+    EXIT_EXITED, // The guest called exit, only returned by hart::run
+    EXIT_INTERRUPTED // cpu.interrupt was set, pc_reg is the next instruction
+};
+
+enum core_kind
+{
+    CORE_SWITCH,
+    CORE_THREADED,
+    CORE_BLOCK
+};
+
+// Every core runs until EBREAK, ECALL, a fault, or cpu.instret reaching limit.
+// cpu.interrupt is checked where control transfers rather than on every
+// instruction, so a straight run of code always finishes first.
+
+// Reference core: one switch over the decoded handler id per instruction
+exit_reason run_switch(cpu_state& cpu, guest_memory& memory, decode_cache& icache, uint64_t limit);
+
+// The reference core, recording every instruction it retires into trace
+exit_reason run_switch_traced(cpu_state& cpu, guest_memory& memory, decode_cache& icache, uint64_t limit, trace_writer& trace);
+
+// Threaded core: every handler dispatches straight to the next one
+exit_reason run_threaded(cpu_state& cpu, guest_memory& memory, decode_cache& icache, uint64_t limit);
+
+// Block core: runs translated basic blocks, chained to their successors.
+// Blocks that would overrun limit are replaced by single-instruction ones.
+exit_reason run_blocks(cpu_state& cpu, guest_memory& memory, decode_cache& icache, block_cache& bcache, uint64_t limit);
+
+#endif
@@ -0,0 +1,273 @@
+#include <atomic>
+#include <cstdint>
+
+#include "core.hpp"
+#include "decode.hpp"
+#include "csr.hpp"
+#include "amo.hpp"
+#include "muldiv.hpp"
+
+// Guest pc of b->ops[i], mixing 2 and 4 byte instructions
+static uint32_t op_pc(const block* b, uint32_t i)
+{
+    uint32_t pc = b->pc;
+    for (uint32_t k = 0; k < i; k++)
+        pc += b->ops[k].len;
+    return pc;
+}
+
+// Basic-block core. Translated blocks are run with the same threaded
+// handlers as run_threaded, but dispatch inside a block is a plain step to
+// the next micro-op, and control only returns here at block ends. Each block
+// remembers its last successors, so a hot loop goes from block to block with
+// a pointer compare instead of a hash lookup.
+exit_reason run_blocks(cpu_state& cpu, guest_memory& memory, decode_cache& icache, block_cache& bcache, uint64_t limit)
+{
+    static const void* const handlers[OP_COUNT] = {
+        &&op_illegal, &&op_illegal,
+        &&op_add, &&op_sub, &&op_xor, &&op_or, &&op_and, &&op_sll, &&op_srl, &&op_sra, &&op_slt, &&op_sltu,
+        &&op_mul, &&op_mulh, &&op_mulhsu, &&op_mulhu, &&op_div, &&op_divu, &&op_rem, &&op_remu,
+        &&op_addi, &&op_xori, &&op_ori, &&op_andi, &&op_slli, &&op_srli, &&op_srai, &&op_slti, &&op_sltiu,
+        &&op_lb, &&op_lh, &&op_lw, &&op_lbu, &&op_lhu,
+        &&op_sb, &&op_sh, &&op_sw,
+        &&op_beq, &&op_bne, &&op_blt, &&op_bge, &&op_bltu, &&op_bgeu,
+        &&op_jal, &&op_jalr,
+        &&op_lui, &&op_illegal, // AUIPC is resolved to LUI at translation
+        &&op_ecall, &&op_ebreak,
+        &&op_fence, &&op_fence_i,
+        &&op_csrrw, &&op_csrrs, &&op_csrrc, &&op_csrrwi, &&op_csrrsi, &&op_csrrci,
+        &&op_amo, &&op_amo,
+        &&op_amo, &&op_amo, &&op_amo, &&op_amo, &&op_amo,
+        &&op_amo, &&op_amo, &&op_amo, &&op_amo,
+        &&op_fetch_fault,
+        &&op_block_end, &&op_illegal,
+        &&op_lui_addi, &&op_auipc_addi, &&op_auipc_jalr, &&op_auipc_lw, &&op_addi_bne,
+    };
+
+    uint32_t* const x = cpu.gp_regs;
+    uint32_t pc = cpu.pc_reg;
+    uint64_t retired = cpu.instret;
+    block* b = bcache.lookup(pc);
+    const decoded_instr* d;
+    uint32_t store_addr, store_len;
+
+// Translation turned x0 writes into OP_NOP, only terminators reset x0
+#define NEXT() do { d++; COUNT(); goto *handlers[d->op]; } while (0)
+#define NEXT_PAIR(kind) do { bcache.fusion_hits[kind - OP_LUI_ADDI]++; d += 2; COUNT(); goto *handlers[d->op]; } while (0)
+#define EXIT_TO(target) do { x[0] = 0; pc = (target); goto chain; } while (0) // JAL/JALR may link into x0
+// The terminator is the block's last instruction, d[i] is the branch itself
+#define BRANCH(i, cond) do { bool taken = (cond); STATS_BRANCH(cpu, b->end_pc - d[i].len, taken); EXIT_TO(taken ? d[i].imm : b->end_pc); } while (0)
+#ifdef BRV_STATS
+// Count the guest instructions d stands for, both of a fused pair
+#define COUNT() do { uint32_t at = d - b->ops.data(); STATS_OP(cpu, b->guest_ops[at]); if (d->op >= OP_LUI_ADDI) STATS_OP(cpu, b->guest_ops[at + 1]); } while (0)
+#else
+#define COUNT() ((void)0)
+#endif
+#define FAULT(addr) do { cpu.fault_addr = (addr); goto fault; } while (0)
+// retired already counts the whole block
+#define RETIRED() (retired - (b->count - (d - b->ops.data())))
+// Stores that overwrite decoded code leave the block right after the store
+#define STORE_CHECK(addr, len) do { if (icache.invalidate(addr, len)) [[unlikely]] { store_addr = addr; store_len = len; goto code_written; } } while (0)
+
+    // An interrupt that came before this store is seen by the load after it
+    std::atomic_ref<uint64_t>(cpu.block_limit).store(limit);
+    if (interrupt_pending(cpu))
+        return EXIT_INTERRUPTED;
+
+enter:
+    // Close to the limit, finish one instruction at a time. An interrupt
+    // drops the limit to 0.
+    if (retired + b->count > std::atomic_ref<uint64_t>(cpu.block_limit).load(std::memory_order_relaxed)) [[unlikely]]
+    {
+        if (retired >= limit || interrupt_pending(cpu))
+        {
+            x[0] = 0;
+            cpu.pc_reg = b->pc;
+            cpu.instret = retired;
+            return retired >= limit ? EXIT_LIMIT : EXIT_INTERRUPTED;
+        }
+        b = bcache.lookup_step(b->pc);
+    }
+    retired += b->count;
+    // Native code doesn't count what it runs
+#if defined(BRV_JIT) && !defined(BRV_STATS)
+    if (b->native)
+    {
+        uint32_t i = b->native(&cpu, memory.data(), icache.code_page_bitmap());
+        if (i == b->ops.size())
+        {
+            pc = cpu.pc_reg;
+            goto chain;
+        }
+        // Bailed out, interpret the rest of the block
+        d = b->ops.data() + i;
+        goto *handlers[d->op];
+    }
+    if (++b->exec_count == JIT_THRESHOLD)
+        bcache.compile_native(b);
+#endif
+    d = b->ops.data();
+    COUNT();
+    goto *handlers[d->op];
+
+op_illegal:
+    NEXT();
+
+#include "handlers.inc"
+
+    // Integer Store S-Type
+op_sb:
+    {
+        uint32_t addr = x[d->rs1] + d->imm;
+        STATS_STORE(cpu, 1);
+        if (!memory.write8(addr, x[d->rs2])) [[unlikely]] FAULT(addr);
+        STORE_CHECK(addr, 1);
+    }
+    NEXT();
+op_sh:
+    {
+        uint32_t addr = x[d->rs1] + d->imm;
+        STATS_STORE(cpu, 2);
+        if (!memory.write16(addr, x[d->rs2])) [[unlikely]] FAULT(addr);
+        STORE_CHECK(addr, 2);
+    }
+    NEXT();
+op_sw:
+    {
+        uint32_t addr = x[d->rs1] + d->imm;
+        STATS_STORE(cpu, 4);
+        if (!memory.write32(addr, x[d->rs2])) [[unlikely]] FAULT(addr);
+        STORE_CHECK(addr, 4);
+    }
+    NEXT();
+
+    // RV32A, LR.W / SC.W / AMO*.W, x0 is put back in case rd was 0
+op_amo:
+    {
+        uint32_t addr = x[d->rs1];
+        uint32_t v;
+        if (!execute_amo(cpu, memory, *d, addr, x[d->rs2], v)) [[unlikely]] FAULT(addr);
+        x[d->rd] = v;
+        x[0] = 0;
+        if (amo_writes(d->op))
+            STORE_CHECK(addr, 4);
+    }
+    NEXT();
+
+    // Block terminators, imm already holds the absolute target
+op_beq:  BRANCH(0, x[d->rs1] == x[d->rs2]);
+op_bne:  BRANCH(0, x[d->rs1] != x[d->rs2]);
+op_blt:  BRANCH(0, (int32_t)x[d->rs1] < (int32_t)x[d->rs2]);
+op_bge:  BRANCH(0, (int32_t)x[d->rs1] >= (int32_t)x[d->rs2]);
+op_bltu: BRANCH(0, x[d->rs1] < x[d->rs2]);
+op_bgeu: BRANCH(0, x[d->rs1] >= x[d->rs2]);
+op_jal:
+    x[d->rd] = b->end_pc;
+    EXIT_TO(d->imm);
+op_jalr:
+    {
+        uint32_t target = (x[d->rs1] + d->imm) & ~1u;
+        x[d->rd] = b->end_pc;
+        EXIT_TO(target);
+    }
+    // Superinstructions, d[0] and d[1] are the fused pair
+op_lui_addi:
+    x[d[0].rd] = d[0].imm;
+    x[d[1].rd] = d[0].imm + d[1].imm;
+    NEXT_PAIR(OP_LUI_ADDI);
+op_auipc_addi:
+    x[d[0].rd] = d[0].imm;
+    x[d[1].rd] = d[0].imm + d[1].imm;
+    NEXT_PAIR(OP_AUIPC_ADDI);
+op_auipc_lw:
+    {
+        x[d[0].rd] = d[0].imm;
+        uint32_t addr = d[0].imm + d[1].imm;
+        STATS_LOAD(cpu, 4);
+        uint32_t v;
+        if (!memory.read32(addr, v)) [[unlikely]]
+        {
+            d++;
+            FAULT(addr);
+        }
+        x[d[1].rd] = v;
+    }
+    NEXT_PAIR(OP_AUIPC_LW);
+op_auipc_jalr:
+    bcache.fusion_hits[OP_AUIPC_JALR - OP_LUI_ADDI]++;
+    x[d[0].rd] = d[0].imm;
+    x[d[1].rd] = b->end_pc;
+    EXIT_TO((d[0].imm + d[1].imm) & ~1u);
+op_addi_bne:
+    bcache.fusion_hits[OP_ADDI_BNE - OP_LUI_ADDI]++;
+    x[d[0].rd] = x[d[0].rs1] + d[0].imm;
+    BRANCH(1, x[d[1].rs1] != x[d[1].rs2]);
+
+op_block_end:
+    EXIT_TO(b->end_pc);
+op_ecall:
+    cpu.pc_reg = b->end_pc;
+    cpu.instret = retired;
+    return EXIT_ECALL;
+op_ebreak:
+    cpu.pc_reg = b->end_pc - d->len;
+    cpu.instret = retired;
+    return EXIT_EBREAK;
+    // Makes this hart's own earlier stores visible to its fetches. Ends its
+    // block, which is freed along with every other one.
+op_fence_i:
+    pc = b->end_pc;
+    icache.clear();
+    bcache.clear();
+    b = bcache.lookup(pc);
+    goto enter;
+op_fetch_fault:
+    FAULT(op_pc(b, d - b->ops.data()));
+fault:
+    {
+        // pc of the faulting op, which doesn't retire
+        uint32_t done = d - b->ops.data();
+        x[0] = 0;
+        cpu.pc_reg = op_pc(b, done);
+        cpu.instret = retired - (b->count - done);
+        return EXIT_FAULT;
+    }
+
+chain:
+    {
+        block* next = b->next[0];
+        if (!next || next->pc != pc)
+        {
+            next = b->next[1];
+            if (!next || next->pc != pc)
+            {
+                next = bcache.lookup(pc);
+                b->next[pc == b->end_pc ? 0 : 1] = next;
+            }
+        }
+        b = next;
+    }
+    goto enter;
+
+code_written:
+    {
+        // Drop the overwritten blocks (possibly this one) and carry on after the store
+        uint32_t done = d - b->ops.data() + 1;
+        pc = op_pc(b, done);
+        retired -= b->count - done;
+        bcache.invalidate(store_addr, store_len);
+        if (bcache.has_garbage())
+            bcache.collect();
+        b = bcache.lookup(pc);
+    }
+    goto enter;
+
+#undef COUNT
+#undef BRANCH
+#undef STORE_CHECK
+#undef RETIRED
+#undef FAULT
+#undef EXIT_TO
+#undef NEXT_PAIR
+#undef NEXT
+}
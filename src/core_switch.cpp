@@ -0,0 +1,8 @@
+#include <cstdint>
+
+#include "core_switch.hpp"
+
+exit_reason run_switch(cpu_state& cpu, guest_memory& memory, decode_cache& icache, uint64_t limit)
+{
+    return run_switch_loop<false>(cpu, memory, icache, limit, nullptr);
+}
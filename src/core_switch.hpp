@@ -0,0 +1,286 @@
+#ifndef CORE_SWITCH_HPP
+#define CORE_SWITCH_HPP
+
+#include <atomic>
+#include <cstdint>
+
+#include "core.hpp"
+#include "decode.hpp"
+#include "csr.hpp"
+#include "amo.hpp"
+#include "muldiv.hpp"
+#include "trace.hpp"
+
+// An instruction as the trace needs it, taken before it runs since a store
+// or FENCE.I may drop the cached decode
+struct traced_instr
+{
+    uint32_t pc;
+    uint32_t raw;
+    bool with_raw;
+    uint8_t len;
+    uint8_t op;
+    uint8_t rd;
+    uint8_t rs2;
+};
+
+// The instruction at pc as it is in memory. Kept out of line, inlined its
+// calls cost the traced core more than tracing does.
+uint32_t trace_read_raw(const guest_memory& memory, uint32_t pc, uint32_t len);
+
+// Only reads the instruction back from memory when the trace has to send
+// it, which in a loop over cached code is hardly ever
+inline traced_instr trace_fetch(const trace_writer& trace, const guest_memory& memory, const decoded_instr& d, uint32_t pc, bool redecoded)
+{
+    traced_instr t = { pc, 0, redecoded || !trace.knows(pc), d.len, d.op, d.rd, d.rs2 };
+    if (t.with_raw) [[unlikely]]
+        t.raw = trace_read_raw(memory, pc, d.len);
+    return t;
+}
+
+// Loads and AMOs trace the value they wrote to rd, stores the one they wrote
+// to memory. There are a few TRACE()s, left to itself -Os makes this a call.
+__attribute__((always_inline)) inline void trace_retired(trace_writer& trace, const traced_instr& t, const uint32_t* x, uint32_t addr)
+{
+    uint32_t value = 0;
+    bool mem = true;
+    switch (t.op)
+    {
+        case OP_LB: case OP_LH: case OP_LW: case OP_LBU: case OP_LHU:
+        case OP_LR_W: case OP_SC_W:
+        case OP_AMOSWAP_W: case OP_AMOADD_W: case OP_AMOXOR_W: case OP_AMOAND_W: case OP_AMOOR_W:
+        case OP_AMOMIN_W: case OP_AMOMAX_W: case OP_AMOMINU_W: case OP_AMOMAXU_W:
+            value = x[t.rd];
+            break;
+        case OP_SB: value = x[t.rs2] & 0xFF; break;
+        case OP_SH: value = x[t.rs2] & 0xFFFF; break;
+        case OP_SW: value = x[t.rs2]; break;
+        default: mem = false; break;
+    }
+    trace.record(t.pc, t.len, t.with_raw, t.raw, t.rd, x[t.rd], mem, addr, value);
+}
+
+// Reference core. The traced copy of the loop also runs every instruction
+// it retires through trace_retired; it's instantiated in its own
+// translation unit so the plain one is compiled as if it wasn't there.
+template <bool TRACED>
+exit_reason run_switch_loop(cpu_state& cpu, guest_memory& memory, decode_cache& icache, uint64_t limit, trace_writer* trace)
+{
+    uint32_t* gp_regs = cpu.gp_regs;
+    uint32_t& pc_reg = cpu.pc_reg;
+
+#define BRANCH(cond) do { branched = (cond); STATS_BRANCH(cpu, pc_reg, branched); if (branched) pc_reg += d.imm; } while (0)
+#define TRACE() do { if constexpr (TRACED) trace_retired(*trace, t, gp_regs, ls_offset); } while (0)
+
+    // Stepping past an instruction gets at most to the end of memory, only
+    // a branch or jump can take pc anywhere else, so the fetch itself is
+    // unchecked and pc is checked on entry and after a branch instead
+    if (!icache.in_table(pc_reg)) [[unlikely]]
+        goto outside;
+    for (;;)
+    {
+        if (cpu.instret >= limit) [[unlikely]]
+            return EXIT_LIMIT;
+
+        // A miss means memory may hold something the trace hasn't seen there
+        [[maybe_unused]] bool redecoded = false;
+        if constexpr (TRACED)
+            redecoded = icache.slot(pc_reg).op == OP_UNDECODED;
+
+        const decoded_instr& d = icache.sequential_fetch(pc_reg);
+        STATS_OP(cpu, d.op);
+        cpu.instret++;
+
+        [[maybe_unused]] traced_instr t;
+        if constexpr (TRACED)
+            t = trace_fetch(*trace, memory, d, pc_reg, redecoded);
+
+        bool branched = false;
+
+        uint32_t ls_offset = 0;
+        uint8_t byte;
+        uint16_t half;
+        uint32_t word;
+
+        switch (d.op)
+        {
+            // Integer ALU R-Type
+            case OP_ADD:  gp_regs[d.rd] = gp_regs[d.rs1] + gp_regs[d.rs2]; break;
+            case OP_SUB:  gp_regs[d.rd] = gp_regs[d.rs1] - gp_regs[d.rs2]; break;
+            case OP_XOR:  gp_regs[d.rd] = gp_regs[d.rs1] ^ gp_regs[d.rs2]; break;
+            case OP_OR:   gp_regs[d.rd] = gp_regs[d.rs1] | gp_regs[d.rs2]; break;
+            case OP_AND:  gp_regs[d.rd] = gp_regs[d.rs1] & gp_regs[d.rs2]; break;
+            case OP_SLL:  gp_regs[d.rd] = gp_regs[d.rs1] << (gp_regs[d.rs2] & 0x1F); break;
+            case OP_SRL:  gp_regs[d.rd] = gp_regs[d.rs1] >> (gp_regs[d.rs2] & 0x1F); break;
+            case OP_SRA:  gp_regs[d.rd] = (int32_t)gp_regs[d.rs1] >> (gp_regs[d.rs2] & 0x1F); break;
+            case OP_SLT:  gp_regs[d.rd] = (int32_t)gp_regs[d.rs1] < (int32_t)gp_regs[d.rs2] ? 1 : 0; break;
+            case OP_SLTU: gp_regs[d.rd] = gp_regs[d.rs1] < gp_regs[d.rs2] ? 1 : 0; break;
+            // RV32M
+            case OP_MUL:    gp_regs[d.rd] = gp_regs[d.rs1] * gp_regs[d.rs2]; break;
+            case OP_MULH:   gp_regs[d.rd] = mulh(gp_regs[d.rs1], gp_regs[d.rs2]); break;
+            case OP_MULHSU: gp_regs[d.rd] = mulhsu(gp_regs[d.rs1], gp_regs[d.rs2]); break;
+            case OP_MULHU:  gp_regs[d.rd] = mulhu(gp_regs[d.rs1], gp_regs[d.rs2]); break;
+            case OP_DIV:    gp_regs[d.rd] = div32(gp_regs[d.rs1], gp_regs[d.rs2]); break;
+            case OP_DIVU:   gp_regs[d.rd] = divu32(gp_regs[d.rs1], gp_regs[d.rs2]); break;
+            case OP_REM:    gp_regs[d.rd] = rem32(gp_regs[d.rs1], gp_regs[d.rs2]); break;
+            case OP_REMU:   gp_regs[d.rd] = remu32(gp_regs[d.rs1], gp_regs[d.rs2]); break;
+            // Integer ALU I-Type, imm is already sign-extended (or the shift amount)
+            case OP_ADDI:  gp_regs[d.rd] = gp_regs[d.rs1] + d.imm; break;
+            case OP_XORI:  gp_regs[d.rd] = gp_regs[d.rs1] ^ d.imm; break;
+            case OP_ORI:   gp_regs[d.rd] = gp_regs[d.rs1] | d.imm; break;
+            case OP_ANDI:  gp_regs[d.rd] = gp_regs[d.rs1] & d.imm; break;
+            case OP_SLLI:  gp_regs[d.rd] = gp_regs[d.rs1] << d.imm; break;
+            case OP_SRLI:  gp_regs[d.rd] = gp_regs[d.rs1] >> d.imm; break;
+            case OP_SRAI:  gp_regs[d.rd] = (int32_t)gp_regs[d.rs1] >> d.imm; break;
+            case OP_SLTI:  gp_regs[d.rd] = (int32_t)gp_regs[d.rs1] < d.imm ? 1 : 0; break;
+            case OP_SLTIU: gp_regs[d.rd] = gp_regs[d.rs1] < (uint32_t)d.imm ? 1 : 0; break;
+            // Integer Load I-Type
+            case OP_LB: // LB (Load Byte, sign extended)
+                ls_offset = gp_regs[d.rs1] + d.imm;
+                STATS_LOAD(cpu, 1);
+                if (!memory.read8(ls_offset, byte)) goto fault;
+                gp_regs[d.rd] = (int8_t)byte;
+                break;
+            case OP_LH: // LH (Load Half, sign-extended)
+                ls_offset = gp_regs[d.rs1] + d.imm;
+                STATS_LOAD(cpu, 2);
+                if (!memory.read16(ls_offset, half)) goto fault;
+                gp_regs[d.rd] = (int16_t)half;
+                break;
+            case OP_LW: // LW (Load Word)
+                ls_offset = gp_regs[d.rs1] + d.imm;
+                STATS_LOAD(cpu, 4);
+                if (!memory.read32(ls_offset, word)) goto fault;
+                gp_regs[d.rd] = word;
+                break;
+            case OP_LBU: // LBU (Load Byte Unsigned)
+                ls_offset = gp_regs[d.rs1] + d.imm;
+                STATS_LOAD(cpu, 1);
+                if (!memory.read8(ls_offset, byte)) goto fault;
+                gp_regs[d.rd] = byte;
+                break;
+            case OP_LHU: // LHU (Load Half Unsigned)
+                ls_offset = gp_regs[d.rs1] + d.imm;
+                STATS_LOAD(cpu, 2);
+                if (!memory.read16(ls_offset, half)) goto fault;
+                gp_regs[d.rd] = half;
+                break;
+            // Integer Store S-Type, stores drop any cached decode they overwrite
+            case OP_SB:
+                ls_offset = gp_regs[d.rs1] + d.imm;
+                STATS_STORE(cpu, 1);
+                if (!memory.write8(ls_offset, gp_regs[d.rs2])) goto fault;
+                icache.invalidate(ls_offset, 1);
+                break;
+            case OP_SH:
+                ls_offset = gp_regs[d.rs1] + d.imm;
+                STATS_STORE(cpu, 2);
+                if (!memory.write16(ls_offset, gp_regs[d.rs2])) goto fault;
+                icache.invalidate(ls_offset, 2);
+                break;
+            case OP_SW:
+                ls_offset = gp_regs[d.rs1] + d.imm;
+                STATS_STORE(cpu, 4);
+                if (!memory.write32(ls_offset, gp_regs[d.rs2])) goto fault;
+                icache.invalidate(ls_offset, 4);
+                break;
+            // Integer Branch B-Type
+            case OP_BEQ:  BRANCH(gp_regs[d.rs1] == gp_regs[d.rs2]); break;
+            case OP_BNE:  BRANCH(gp_regs[d.rs1] != gp_regs[d.rs2]); break;
+            case OP_BLT:  BRANCH((int32_t)gp_regs[d.rs1] < (int32_t)gp_regs[d.rs2]); break;
+            case OP_BGE:  BRANCH((int32_t)gp_regs[d.rs1] >= (int32_t)gp_regs[d.rs2]); break;
+            case OP_BLTU: BRANCH(gp_regs[d.rs1] < gp_regs[d.rs2]); break;
+            case OP_BGEU: BRANCH(gp_regs[d.rs1] >= gp_regs[d.rs2]); break;
+            // Integer JAL J-Type
+            case OP_JAL:
+                gp_regs[d.rd] = pc_reg + d.len;
+                branched = true;
+                pc_reg += d.imm;
+                break;
+            // Integer JALR I-Type, target is computed first in case rd == rs1
+            case OP_JALR:
+                {
+                    uint32_t target = (gp_regs[d.rs1] + d.imm) & ~1u;
+                    gp_regs[d.rd] = pc_reg + d.len;
+                    branched = true;
+                    pc_reg = target;
+                }
+                break;
+            // Integer LUI / AUIPC U-Type, imm is already shifted into place
+            case OP_LUI:   gp_regs[d.rd] = d.imm; break;
+            case OP_AUIPC: gp_regs[d.rd] = pc_reg + d.imm; break;
+            // Integer ECALL/EBREAK I-Type
+            case OP_ECALL: TRACE(); pc_reg += 4; return EXIT_ECALL;
+            case OP_EBREAK: TRACE(); return EXIT_EBREAK;
+            // Aligned guest accesses are already single-copy atomic, FENCE
+            // orders them as seen by the other harts
+            case OP_FENCE: std::atomic_thread_fence(std::memory_order_seq_cst); break;
+            // Makes this hart's own earlier stores visible to its fetches
+            case OP_FENCE_I: icache.clear(); break;
+            // RV32A
+            case OP_LR_W: case OP_SC_W:
+            case OP_AMOSWAP_W: case OP_AMOADD_W: case OP_AMOXOR_W: case OP_AMOAND_W: case OP_AMOOR_W:
+            case OP_AMOMIN_W: case OP_AMOMAX_W: case OP_AMOMINU_W: case OP_AMOMAXU_W:
+                ls_offset = gp_regs[d.rs1];
+                if (!execute_amo(cpu, memory, d, ls_offset, gp_regs[d.rs2], word))
+                    goto fault;
+                gp_regs[d.rd] = word;
+                if (amo_writes(d.op))
+                    icache.invalidate(ls_offset, 4);
+                break;
+            // Zicsr
+            case OP_CSRRW: case OP_CSRRS: case OP_CSRRC:
+            case OP_CSRRWI: case OP_CSRRSI: case OP_CSRRCI:
+                // instret already counts this instruction
+                cpu.instret--;
+                gp_regs[d.rd] = csr_access(cpu, d);
+                cpu.instret++;
+                break;
+            case OP_FETCH_FAULT: ls_offset = pc_reg; goto fault;
+        }
+
+        // Reset zero/x0 register to 0. Prevent branching.
+        gp_regs[0] = 0;
+        TRACE();
+
+        // Increment PC if we haven't branched/jumped. Branching on the length
+        // rather than adding it keeps the next fetch off the load of this
+        // entry. Stores leave d.len alone, and FENCE.I (which clears it) is
+        // never compressed.
+        if (!branched)
+        {
+            if (d.len == 2) [[unlikely]]
+                pc_reg += 2;
+            else
+                pc_reg += 4;
+        }
+        else if (interrupt_pending(cpu)) [[unlikely]]
+        {
+            return EXIT_INTERRUPTED;
+        }
+        else if (!icache.in_table(pc_reg)) [[unlikely]]
+        {
+            goto outside;
+        }
+        continue;
+
+    fault:
+        // The faulting instruction doesn't retire, pc_reg still points at it
+        gp_regs[0] = 0;
+        cpu.instret--;
+        cpu.fault_addr = ls_offset;
+        return EXIT_FAULT;
+    }
+
+outside:
+    // What fetching the shared fault entry would do, once the budget allows
+    if (cpu.instret >= limit)
+        return EXIT_LIMIT;
+    cpu.fault_addr = pc_reg;
+    return EXIT_FAULT;
+
+#undef TRACE
+#undef BRANCH
+}
+
+#endif
@@ -0,0 +1,17 @@
+#include <cstdint>
+
+#include "core_switch.hpp"
+
+__attribute__((noinline)) uint32_t trace_read_raw(const guest_memory& memory, uint32_t pc, uint32_t len)
+{
+    uint16_t low = 0, high = 0;
+    memory.read16(pc, low);
+    if (len == 4)
+        memory.read16(pc + 2, high);
+    return low | (uint32_t)high << 16;
+}
+
+exit_reason run_switch_traced(cpu_state& cpu, guest_memory& memory, decode_cache& icache, uint64_t limit, trace_writer& trace)
+{
+    return run_switch_loop<true>(cpu, memory, icache, limit, &trace);
+}
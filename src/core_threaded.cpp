@@ -0,0 +1,185 @@
+#include <atomic>
+#include <cstdint>
+
+#include "core.hpp"
+#include "decode.hpp"
+#include "csr.hpp"
+#include "amo.hpp"
+#include "muldiv.hpp"
+
+// Token-threaded interpreter. Every handler ends in its own indirect jump
+// through the handler table, so each one gets a separate branch history
+// instead of sharing the single dispatch branch of the switch core. A
+// decode cache miss is just another handler (OP_UNDECODED), which keeps the
+// miss check off the hot path.
+//
+// The instruction limit costs a compare on every dispatch, so runs without
+// one get their own copy of the loop that leaves it out.
+template <bool LIMITED>
+static exit_reason run_threaded_loop(cpu_state& cpu, guest_memory& memory, decode_cache& icache, uint64_t limit)
+{
+    static const void* const handlers[OP_COUNT] = {
+        &&op_undecoded, &&op_illegal,
+        &&op_add, &&op_sub, &&op_xor, &&op_or, &&op_and, &&op_sll, &&op_srl, &&op_sra, &&op_slt, &&op_sltu,
+        &&op_mul, &&op_mulh, &&op_mulhsu, &&op_mulhu, &&op_div, &&op_divu, &&op_rem, &&op_remu,
+        &&op_addi, &&op_xori, &&op_ori, &&op_andi, &&op_slli, &&op_srli, &&op_srai, &&op_slti, &&op_sltiu,
+        &&op_lb, &&op_lh, &&op_lw, &&op_lbu, &&op_lhu,
+        &&op_sb, &&op_sh, &&op_sw,
+        &&op_beq, &&op_bne, &&op_blt, &&op_bge, &&op_bltu, &&op_bgeu,
+        &&op_jal, &&op_jalr,
+        &&op_lui, &&op_auipc,
+        &&op_ecall, &&op_ebreak,
+        &&op_fence, &&op_fence_i,
+        &&op_csrrw, &&op_csrrs, &&op_csrrc, &&op_csrrwi, &&op_csrrsi, &&op_csrrci,
+        &&op_amo, &&op_amo,
+        &&op_amo, &&op_amo, &&op_amo, &&op_amo, &&op_amo,
+        &&op_amo, &&op_amo, &&op_amo, &&op_amo,
+        &&op_fetch_fault,
+    };
+
+    uint32_t* const x = cpu.gp_regs;
+    uint32_t pc = cpu.pc_reg;
+    uint64_t retired = cpu.instret;
+    const decoded_instr* d;
+
+// x0 is reset before every dispatch, same as the switch core. A miss is
+// counted by op_undecoded once it knows the op. Only a jump can take pc
+// anywhere outside memory, stepping gets at most to its end, so only
+// JUMP pays for the range check.
+#define DISPATCH_FROM(lookup) do { x[0] = 0; if (LIMITED && retired >= limit) [[unlikely]] goto out_of_budget; retired++; d = &icache.lookup(pc); if (d->op != OP_UNDECODED) STATS_OP(cpu, d->op); goto *handlers[d->op]; } while (0)
+#define DISPATCH() DISPATCH_FROM(sequential_slot)
+// Adding d->len to pc would chain every dispatch through a load of the
+// previous entry, so the step is a predicted branch instead and a run of
+// 32-bit code only ever adds 4
+#define STEP() do { if (d->len != 4) [[unlikely]] { pc += 2; DISPATCH(); } pc += 4; } while (0)
+#define NEXT() do { STEP(); DISPATCH(); } while (0)
+#define FAULT(addr) do { cpu.fault_addr = (addr); goto fault; } while (0)
+#define RETIRED() (retired - 1)
+// Taken branches and jumps are where an interrupt is noticed
+#define JUMP(target) do { pc = (target); if (interrupt_pending(cpu)) [[unlikely]] goto interrupted; DISPATCH_FROM(slot); } while (0)
+#define BRANCH(cond) do { bool taken = (cond); STATS_BRANCH(cpu, pc, taken); if (taken) JUMP(pc + d->imm); STEP(); DISPATCH(); } while (0)
+
+    DISPATCH_FROM(slot);
+
+op_undecoded:
+    d = &icache.fetch(pc);
+    STATS_OP(cpu, d->op);
+    goto *handlers[d->op];
+op_illegal:
+    NEXT();
+
+#include "handlers.inc"
+
+    // Integer Store S-Type
+op_sb:
+    {
+        uint32_t addr = x[d->rs1] + d->imm;
+        STATS_STORE(cpu, 1);
+        if (!memory.write8(addr, x[d->rs2])) [[unlikely]] FAULT(addr);
+        icache.invalidate(addr, 1);
+    }
+    NEXT();
+op_sh:
+    {
+        uint32_t addr = x[d->rs1] + d->imm;
+        STATS_STORE(cpu, 2);
+        if (!memory.write16(addr, x[d->rs2])) [[unlikely]] FAULT(addr);
+        icache.invalidate(addr, 2);
+    }
+    NEXT();
+op_sw:
+    {
+        uint32_t addr = x[d->rs1] + d->imm;
+        STATS_STORE(cpu, 4);
+        if (!memory.write32(addr, x[d->rs2])) [[unlikely]] FAULT(addr);
+        icache.invalidate(addr, 4);
+    }
+    NEXT();
+
+    // RV32A, LR.W / SC.W / AMO*.W
+op_amo:
+    {
+        uint32_t addr = x[d->rs1];
+        uint32_t v;
+        if (!execute_amo(cpu, memory, *d, addr, x[d->rs2], v)) [[unlikely]] FAULT(addr);
+        x[d->rd] = v;
+        if (amo_writes(d->op))
+            icache.invalidate(addr, 4);
+    }
+    NEXT();
+
+    // Integer Branch B-Type
+op_beq:  BRANCH(x[d->rs1] == x[d->rs2]);
+op_bne:  BRANCH(x[d->rs1] != x[d->rs2]);
+op_blt:  BRANCH((int32_t)x[d->rs1] < (int32_t)x[d->rs2]);
+op_bge:  BRANCH((int32_t)x[d->rs1] >= (int32_t)x[d->rs2]);
+op_bltu: BRANCH(x[d->rs1] < x[d->rs2]);
+op_bgeu: BRANCH(x[d->rs1] >= x[d->rs2]);
+
+    // Integer JAL / JALR
+op_jal:
+    x[d->rd] = pc + d->len;
+    JUMP(pc + d->imm);
+op_jalr:
+    {
+        uint32_t target = (x[d->rs1] + d->imm) & ~1u;
+        x[d->rd] = pc + d->len;
+        JUMP(target);
+    }
+
+    // Integer AUIPC U-Type
+op_auipc: x[d->rd] = pc + d->imm; NEXT();
+
+op_ebreak:
+    x[0] = 0;
+    cpu.pc_reg = pc;
+    cpu.instret = retired;
+    return EXIT_EBREAK;
+op_ecall:
+    x[0] = 0;
+    cpu.pc_reg = pc + 4;
+    cpu.instret = retired;
+    return EXIT_ECALL;
+
+    // Makes this hart's own earlier stores visible to its fetches. Clearing
+    // the cache also wipes the entry d points at, FENCE.I is always 4 bytes.
+op_fence_i:
+    icache.clear();
+    pc += 4;
+    DISPATCH();
+
+out_of_budget:
+    cpu.pc_reg = pc;
+    cpu.instret = retired;
+    return EXIT_LIMIT;
+interrupted:
+    x[0] = 0;
+    cpu.pc_reg = pc;
+    cpu.instret = retired;
+    return EXIT_INTERRUPTED;
+
+op_fetch_fault:
+    FAULT(pc);
+fault:
+    // The faulting instruction doesn't retire
+    x[0] = 0;
+    cpu.pc_reg = pc;
+    cpu.instret = retired - 1;
+    return EXIT_FAULT;
+
+#undef BRANCH
+#undef JUMP
+#undef RETIRED
+#undef FAULT
+#undef NEXT
+#undef STEP
+#undef DISPATCH
+#undef DISPATCH_FROM
+}
+
+exit_reason run_threaded(cpu_state& cpu, guest_memory& memory, decode_cache& icache, uint64_t limit)
+{
+    if (limit == UINT64_MAX)
+        return run_threaded_loop<false>(cpu, memory, icache, limit);
+    return run_threaded_loop<true>(cpu, memory, icache, limit);
+}
@@ -0,0 +1,55 @@
+#ifndef CPU_HPP
+#define CPU_HPP
+
+#include <atomic>
+#include <cstdint>
+
+#include "stats.hpp"
+
+// Architectural state of one hart
+struct cpu_state
+{
+    uint32_t gp_regs[32] = { 0 };
+    uint32_t pc_reg = 0;
+    uint64_t instret = 0; // Instructions retired
+    uint32_t fault_addr = 0; // Guest address behind the last EXIT_FAULT
+    uint32_t hart_id = 0;    // mhartid
+    int64_t time_origin = 0; // Host steady_clock nanoseconds where the time CSR reads 0
+
+    // LR.W reservation: address (1 when there is none), the value loaded and
+    // the version of its granule at the time
+    uint32_t reserved_addr = 1;
+    uint32_t reserved_value = 0;
+    uint32_t reserved_version = 0;
+
+    // Nonzero once another thread has asked the hart to stop, see
+    // hart::interrupt. Only read at block boundaries.
+    uint32_t interrupt = 0;
+    // The block core's limit, which an interrupt drops to 0 so the block
+    // core's one compare against it catches both
+    uint64_t block_limit = 0;
+
+#ifdef BRV_STATS
+    exec_stats stats;
+#endif
+};
+
+inline bool interrupt_pending(cpu_state& cpu)
+{
+    return std::atomic_ref<uint32_t>(cpu.interrupt).load(std::memory_order_relaxed) != 0;
+}
+
+// Safe from any thread. The flag goes first, the block core sets its limit
+// before checking it.
+inline void request_interrupt(cpu_state& cpu)
+{
+    std::atomic_ref<uint32_t>(cpu.interrupt).store(1);
+    std::atomic_ref<uint64_t>(cpu.block_limit).store(0);
+}
+
+inline void clear_interrupt(cpu_state& cpu)
+{
+    std::atomic_ref<uint32_t>(cpu.interrupt).store(0, std::memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,33 @@
+#include <chrono>
+#include <cstdint>
+
+#include "csr.hpp"
+
+static uint64_t timer_ticks(const cpu_state& cpu)
+{
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    return (uint64_t)(now - cpu.time_origin) / (1000000000 / TIMEBASE_HZ);
+}
+
+static uint32_t csr_read(const cpu_state& cpu, uint32_t csr)
+{
+    switch (csr)
+    {
+        case CSR_MHARTID: return cpu.hart_id;
+        case CSR_CYCLE: case CSR_MCYCLE:
+        case CSR_INSTRET: case CSR_MINSTRET:
+            return cpu.instret;
+        case CSR_CYCLEH: case CSR_MCYCLEH:
+        case CSR_INSTRETH: case CSR_MINSTRETH:
+            return cpu.instret >> 32;
+        case CSR_TIME:    return timer_ticks(cpu);
+        case CSR_TIMEH:   return timer_ticks(cpu) >> 32;
+        default:          return 0;
+    }
+}
+
+uint32_t csr_access(const cpu_state& cpu, const decoded_instr& d)
+{
+    return csr_read(cpu, d.imm);
+}
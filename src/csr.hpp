@@ -0,0 +1,34 @@
+#ifndef CSR_HPP
+#define CSR_HPP
+
+#include <cstdint>
+
+#include "cpu.hpp"
+#include "decode.hpp"
+
+const uint32_t CSR_MHARTID = 0xF14;
+
+// Zicntr counters and their upper halves. cycle counts one per retired
+// instruction, time ticks at 10 MHz (the usual RISC-V timebase) from when
+// the hart was reset. The machine-mode copies read the same values.
+const uint32_t CSR_CYCLE = 0xC00;
+const uint32_t CSR_TIME = 0xC01;
+const uint32_t CSR_INSTRET = 0xC02;
+const uint32_t CSR_CYCLEH = 0xC80;
+const uint32_t CSR_TIMEH = 0xC81;
+const uint32_t CSR_INSTRETH = 0xC82;
+const uint32_t CSR_MCYCLE = 0xB00;
+const uint32_t CSR_MINSTRET = 0xB02;
+const uint32_t CSR_MCYCLEH = 0xB80;
+const uint32_t CSR_MINSTRETH = 0xB82;
+
+const uint64_t TIMEBASE_HZ = 10000000;
+
+// Zicsr access to the CSR numbered d.imm, returns the old value for rd.
+// Nothing can be written yet: an instruction writing a read-only CSR
+// (numbers 0b11xx_xxxx_xxxx) decodes to OP_ILLEGAL and is ignored whole,
+// other writes are ignored and CSRs that don't exist read as 0.
+// cpu.instret must count the instructions retired before this one.
+uint32_t csr_access(const cpu_state& cpu, const decoded_instr& d);
+
+#endif
@@ -1,5 +1,6 @@
 #include <string>
 #include <iostream>
+#include <map>
 #include <fmt/core.h>
 #include <nlohmann/json.hpp>
 #include "debug.hpp"
@@ -31,4 +32,47 @@ std::string spit_registers_json(const uint32_t* regs, const uint32_t& pc)
     json.emplace("PCR", std::to_string(pc));
     // Pretty print it
     return json.dump(4);
-}
\ No newline at end of file
+}
+
+std::string stats_json(const exec_stats& stats)
+{
+    nlohmann::ordered_json json;
+
+    // Guest instructions only, not the cores' own bookkeeping ops
+    uint64_t total = 0;
+    nlohmann::ordered_json ops = nlohmann::ordered_json::object();
+    for (uint32_t op = OP_ILLEGAL; op < OP_COUNT; op++)
+    {
+        if (op == OP_FETCH_FAULT || op >= OP_BLOCK_END || stats.ops[op] == 0)
+            continue;
+        ops[op_names[op]] = stats.ops[op];
+        total += stats.ops[op];
+    }
+    json["instructions"] = total;
+    json["opcodes"] = ops;
+
+    // Static branches in address order
+    std::map<uint32_t, branch_counts> sorted(stats.branches.begin(), stats.branches.end());
+    nlohmann::ordered_json branches = nlohmann::ordered_json::array();
+    for (const auto& [pc, counts] : sorted)
+    {
+        nlohmann::ordered_json b;
+        b["pc"] = fmt::format("{:08x}", pc);
+        b["taken"] = counts.taken;
+        b["not_taken"] = counts.not_taken;
+        b["taken_ratio"] = (double)counts.taken / (counts.taken + counts.not_taken);
+        branches.push_back(b);
+    }
+    json["branches"] = branches;
+
+    const char* const widths[3] = { "byte", "half", "word" };
+    nlohmann::ordered_json loads, stores;
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        loads[widths[i]] = stats.loads[i];
+        stores[widths[i]] = stats.stores[i];
+    }
+    json["loads"] = loads;
+    json["stores"] = stores;
+    return json.dump(4);
+}
@@ -1,6 +1,8 @@
 #include <string>
 #include "unions.hpp"
+#include "stats.hpp"
 
 void unimplemented_instr(instr unimp, uint32_t* regs, uint32_t pc);
 void spit_registers(uint32_t* regs, uint32_t pc);
-std::string spit_registers_json(const uint32_t* regs, const uint32_t& pc);
\ No newline at end of file
+std::string spit_registers_json(const uint32_t* regs, const uint32_t& pc);
+std::string stats_json(const exec_stats& stats);
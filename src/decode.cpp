@@ -0,0 +1,408 @@
+#include <cstdint>
+
+#include "decode.hpp"
+#include "unions.hpp"
+
+const char* const op_names[OP_COUNT] = {
+    "UNDECODED", "ILLEGAL",
+    "ADD", "SUB", "XOR", "OR", "AND", "SLL", "SRL", "SRA", "SLT", "SLTU",
+    "MUL", "MULH", "MULHSU", "MULHU", "DIV", "DIVU", "REM", "REMU",
+    "ADDI", "XORI", "ORI", "ANDI", "SLLI", "SRLI", "SRAI", "SLTI", "SLTIU",
+    "LB", "LH", "LW", "LBU", "LHU",
+    "SB", "SH", "SW",
+    "BEQ", "BNE", "BLT", "BGE", "BLTU", "BGEU",
+    "JAL", "JALR",
+    "LUI", "AUIPC",
+    "ECALL", "EBREAK",
+    "FENCE", "FENCE.I",
+    "CSRRW", "CSRRS", "CSRRC", "CSRRWI", "CSRRSI", "CSRRCI",
+    "LR.W", "SC.W",
+    "AMOSWAP.W", "AMOADD.W", "AMOXOR.W", "AMOAND.W", "AMOOR.W",
+    "AMOMIN.W", "AMOMAX.W", "AMOMINU.W", "AMOMAXU.W",
+    "FETCH_FAULT",
+    "BLOCK_END", "NOP",
+    "LUI+ADDI", "AUIPC+ADDI", "AUIPC+JALR", "AUIPC+LW", "ADDI+BNE",
+};
+
+decoded_instr decode_instr(uint32_t word)
+{
+    instr i; i.instruction = word;
+    decoded_instr d = { OP_ILLEGAL, 0, 0, 0, 4, 0 };
+    imm_reconstruct imm; imm.word = 0;
+
+    switch (i.op_only.opcode)
+    {
+        case 0b0110011: // Integer ALU R-Type, RV32M under funct7 0x01
+            d.rd = i.r_type.rd;
+            d.rs1 = i.r_type.rs1;
+            d.rs2 = i.r_type.rs2;
+            if (i.r_type.funct7 == 0x01)
+            {
+                switch (i.r_type.funct3)
+                {
+                    case 0x0: d.op = OP_MUL; break;
+                    case 0x1: d.op = OP_MULH; break;
+                    case 0x2: d.op = OP_MULHSU; break;
+                    case 0x3: d.op = OP_MULHU; break;
+                    case 0x4: d.op = OP_DIV; break;
+                    case 0x5: d.op = OP_DIVU; break;
+                    case 0x6: d.op = OP_REM; break;
+                    case 0x7: d.op = OP_REMU; break;
+                }
+                break;
+            }
+            switch (i.r_type.funct3)
+            {
+                case 0x0: // ADD / SUB
+                    switch (i.r_type.funct7)
+                    {
+                        case 0x00: d.op = OP_ADD; break;
+                        case 0x20: d.op = OP_SUB; break;
+                    }
+                    break;
+                case 0x4: if (i.r_type.funct7 == 0x00) d.op = OP_XOR; break;
+                case 0x6: if (i.r_type.funct7 == 0x00) d.op = OP_OR; break;
+                case 0x7: if (i.r_type.funct7 == 0x00) d.op = OP_AND; break;
+                case 0x1: if (i.r_type.funct7 == 0x00) d.op = OP_SLL; break;
+                case 0x5: // SRL / SRA
+                    switch (i.r_type.funct7)
+                    {
+                        case 0x00: d.op = OP_SRL; break;
+                        case 0x20: d.op = OP_SRA; break;
+                    }
+                    break;
+                case 0x2: if (i.r_type.funct7 == 0x00) d.op = OP_SLT; break;
+                case 0x3: if (i.r_type.funct7 == 0x00) d.op = OP_SLTU; break;
+            }
+            break;
+        case 0b0010011: // Integer ALU I-Type
+            d.rd = i.i_type.rd;
+            d.rs1 = i.i_type.rs1;
+            d.imm = sign_extend(i.i_type.imm, 20);
+            switch (i.i_type.funct3)
+            {
+                case 0x0: d.op = OP_ADDI; break;
+                case 0x4: d.op = OP_XORI; break;
+                case 0x6: d.op = OP_ORI; break;
+                case 0x7: d.op = OP_ANDI; break;
+                case 0x2: d.op = OP_SLTI; break;
+                case 0x3: d.op = OP_SLTIU; break;
+                case 0x1: // SLLI, imm becomes the shift amount
+                    d.op = OP_SLLI;
+                    d.imm &= 0x1F;
+                    break;
+                case 0x5: // SRLI / SRAI, told apart by the upper 7 bits of imm
+                    switch ((i.i_type.imm & 0b111111100000) >> 5)
+                    {
+                        case 0x00: d.op = OP_SRLI; break;
+                        case 0x20: d.op = OP_SRAI; break;
+                    }
+                    d.imm &= 0x1F;
+                    break;
+            }
+            break;
+        case 0b0000011: // Integer Load I-Type
+            d.rd = i.i_type.rd;
+            d.rs1 = i.i_type.rs1;
+            d.imm = sign_extend(i.i_type.imm, 20);
+            switch (i.i_type.funct3)
+            {
+                case 0x0: d.op = OP_LB; break;
+                case 0x1: d.op = OP_LH; break;
+                case 0x2: d.op = OP_LW; break;
+                case 0x4: d.op = OP_LBU; break;
+                case 0x5: d.op = OP_LHU; break;
+            }
+            break;
+        case 0b0100011: // Integer Store S-Type
+            imm.s_imm = {i.s_type.imm4_0, i.s_type.imm11_5, 0};
+            d.rs1 = i.s_type.rs1;
+            d.rs2 = i.s_type.rs2;
+            d.imm = sign_extend(imm.word, 20);
+            switch (i.s_type.funct3)
+            {
+                case 0x0: d.op = OP_SB; break;
+                case 0x1: d.op = OP_SH; break;
+                case 0x2: d.op = OP_SW; break;
+            }
+            break;
+        case 0b1100011: // Integer Branch B-Type
+            imm.b_imm = {0, i.b_type.imm4_1, i.b_type.imm10_5, i.b_type.imm11, i.b_type.imm12, 0};
+            d.rs1 = i.b_type.rs1;
+            d.rs2 = i.b_type.rs2;
+            d.imm = sign_extend(imm.word, 19);
+            switch (i.b_type.funct3)
+            {
+                case 0x0: d.op = OP_BEQ; break;
+                case 0x1: d.op = OP_BNE; break;
+                case 0x4: d.op = OP_BLT; break;
+                case 0x5: d.op = OP_BGE; break;
+                case 0x6: d.op = OP_BLTU; break;
+                case 0x7: d.op = OP_BGEU; break;
+            }
+            break;
+        case 0b1101111: // Integer JAL J-Type
+            imm.j_imm = {0, i.j_type.imm10_1, i.j_type.imm11, i.j_type.imm19_12, i.j_type.imm20, 0};
+            d.op = OP_JAL;
+            d.rd = i.j_type.rd;
+            d.imm = sign_extend(imm.word, 11);
+            break;
+        case 0b1100111: // Integer JALR I-Type
+            if (i.i_type.funct3 == 0x0)
+            {
+                d.op = OP_JALR;
+                d.rd = i.i_type.rd;
+                d.rs1 = i.i_type.rs1;
+                d.imm = sign_extend(i.i_type.imm, 20);
+            }
+            break;
+        case 0b0110111: // Integer LUI U-Type
+            d.op = OP_LUI;
+            d.rd = i.u_type.rd;
+            d.imm = (uint32_t)i.u_type.imm31_12 << 12;
+            break;
+        case 0b0010111: // Integer AUIPC U-Type
+            d.op = OP_AUIPC;
+            d.rd = i.u_type.rd;
+            d.imm = (uint32_t)i.u_type.imm31_12 << 12;
+            break;
+        case 0b0101111: // Atomic A-Type, aq/rl are implied by the host atomics
+            if (i.a_type.funct3 != 0x2)
+                break;
+            d.rd = i.a_type.rd;
+            d.rs1 = i.a_type.rs1;
+            d.rs2 = i.a_type.rs2;
+            switch (i.a_type.funct5)
+            {
+                case 0x02: if (i.a_type.rs2 == 0) d.op = OP_LR_W; break;
+                case 0x03: d.op = OP_SC_W; break;
+                case 0x01: d.op = OP_AMOSWAP_W; break;
+                case 0x00: d.op = OP_AMOADD_W; break;
+                case 0x04: d.op = OP_AMOXOR_W; break;
+                case 0x0C: d.op = OP_AMOAND_W; break;
+                case 0x08: d.op = OP_AMOOR_W; break;
+                case 0x10: d.op = OP_AMOMIN_W; break;
+                case 0x14: d.op = OP_AMOMAX_W; break;
+                case 0x18: d.op = OP_AMOMINU_W; break;
+                case 0x1C: d.op = OP_AMOMAXU_W; break;
+            }
+            break;
+        case 0b0001111: // FENCE / FENCE.I
+            switch (i.i_type.funct3)
+            {
+                case 0x0: d.op = OP_FENCE; break;
+                case 0x1: d.op = OP_FENCE_I; break;
+            }
+            break;
+        case 0b1110011: // Integer ECALL/EBREAK I-Type, Zicsr
+            if (i.i_type.funct3 == 0x0)
+            {
+                switch (i.i_type.imm)
+                {
+                    case 0x0: d.op = OP_ECALL; break;
+                    case 0x1: d.op = OP_EBREAK; break;
+                }
+                break;
+            }
+            d.rd = i.i_type.rd;
+            d.rs1 = i.i_type.rs1;
+            d.imm = i.i_type.imm;
+            switch (i.i_type.funct3)
+            {
+                case 0x1: d.op = OP_CSRRW; break;
+                case 0x2: d.op = OP_CSRRS; break;
+                case 0x3: d.op = OP_CSRRC; break;
+                case 0x5: d.op = OP_CSRRWI; break;
+                case 0x6: d.op = OP_CSRRSI; break;
+                case 0x7: d.op = OP_CSRRCI; break;
+            }
+            // CSRs numbered 0b11xx_xxxx_xxxx are read-only. The spec makes
+            // writing one an illegal instruction exception, which brv can't
+            // raise, so the write is dropped along with the rest of the
+            // instruction: rd isn't written either. CSRRS/CSRRC with rs1
+            // (or uimm) 0 only read.
+            if (d.op != OP_ILLEGAL && (d.imm >> 10) == 3 && (d.op == OP_CSRRW || d.op == OP_CSRRWI || d.rs1 != 0))
+                d = { OP_ILLEGAL, 0, 0, 0, 4, 0 };
+            break;
+    }
+
+    return d;
+}
+
+// Bits hi..lo of a compressed instruction, shifted down to bit 0
+static uint32_t cbits(uint16_t half, uint32_t hi, uint32_t lo)
+{
+    return (half >> lo) & ((1u << (hi - lo + 1)) - 1);
+}
+
+decoded_instr decode_compressed(uint16_t half)
+{
+    instr i; i.instruction = half;
+    decoded_instr d = { OP_ILLEGAL, 0, 0, 0, 2, 0 };
+
+    // 3-bit register fields name x8..x15
+    uint8_t rd_c = i.cl_type.rd + 8;
+    uint8_t rs1_c = i.cl_type.rs1 + 8;
+    uint8_t rd_rs1 = i.ci_type.rd_rs1;
+    // CI-format 6-bit immediate, imm[5] in bit 12
+    int32_t ci_imm = sign_extend((cbits(half, 12, 12) << 5) | cbits(half, 6, 2), 26);
+    // CL/CS-format word offset: uimm[5:3] in 12:10, uimm[2] in 6, uimm[6] in 5
+    int32_t cl_imm = (cbits(half, 12, 10) << 3) | (cbits(half, 6, 6) << 2) | (cbits(half, 5, 5) << 6);
+
+    switch ((i.ci_type.funct3 << 2) | i.ci_type.op)
+    {
+        // Quadrant 0
+        case 0b00000: // C.ADDI4SPN -> addi rd', x2, nzuimm
+            d.imm = (cbits(half, 12, 11) << 4) | (cbits(half, 10, 7) << 6) | (cbits(half, 6, 6) << 2) | (cbits(half, 5, 5) << 3);
+            if (d.imm != 0)
+            {
+                d.op = OP_ADDI;
+                d.rd = i.ciw_type.rd + 8;
+                d.rs1 = 2;
+            }
+            break;
+        case 0b01000: // C.LW -> lw rd', uimm(rs1')
+            d.op = OP_LW;
+            d.rd = rd_c;
+            d.rs1 = rs1_c;
+            d.imm = cl_imm;
+            break;
+        case 0b11000: // C.SW -> sw rs2', uimm(rs1')
+            d.op = OP_SW;
+            d.rs1 = rs1_c;
+            d.rs2 = i.cs_type.rs2 + 8;
+            d.imm = cl_imm;
+            break;
+
+        // Quadrant 1
+        case 0b00001: // C.ADDI / C.NOP -> addi rd, rd, imm
+            d.op = OP_ADDI;
+            d.rd = rd_rs1;
+            d.rs1 = rd_rs1;
+            d.imm = ci_imm;
+            break;
+        case 0b00101: // C.JAL -> jal x1, offset
+        case 0b10101: // C.J -> jal x0, offset
+            d.op = OP_JAL;
+            d.rd = (i.ci_type.funct3 == 0b001) ? 1 : 0;
+            d.imm = sign_extend((cbits(half, 12, 12) << 11) | (cbits(half, 11, 11) << 4) | (cbits(half, 10, 9) << 8) |
+                                (cbits(half, 8, 8) << 10) | (cbits(half, 7, 7) << 6) | (cbits(half, 6, 6) << 7) |
+                                (cbits(half, 5, 3) << 1) | (cbits(half, 2, 2) << 5), 20);
+            break;
+        case 0b01001: // C.LI -> addi rd, x0, imm
+            d.op = OP_ADDI;
+            d.rd = rd_rs1;
+            d.imm = ci_imm;
+            break;
+        case 0b01101:
+            if (rd_rs1 == 2) // C.ADDI16SP -> addi x2, x2, nzimm
+            {
+                d.imm = sign_extend((cbits(half, 12, 12) << 9) | (cbits(half, 6, 6) << 4) | (cbits(half, 5, 5) << 6) |
+                                    (cbits(half, 4, 3) << 7) | (cbits(half, 2, 2) << 5), 22);
+                if (d.imm != 0)
+                {
+                    d.op = OP_ADDI;
+                    d.rd = 2;
+                    d.rs1 = 2;
+                }
+            }
+            else if (ci_imm != 0) // C.LUI -> lui rd, nzimm
+            {
+                d.op = OP_LUI;
+                d.rd = rd_rs1;
+                d.imm = (uint32_t)ci_imm << 12;
+            }
+            break;
+        case 0b10001: // Compressed ALU on rd' = rs1'
+            d.rd = rs1_c;
+            d.rs1 = rs1_c;
+            switch (cbits(half, 11, 10))
+            {
+                case 0b00: if (!cbits(half, 12, 12)) { d.op = OP_SRLI; d.imm = cbits(half, 6, 2); } break;
+                case 0b01: if (!cbits(half, 12, 12)) { d.op = OP_SRAI; d.imm = cbits(half, 6, 2); } break;
+                case 0b10: d.op = OP_ANDI; d.imm = ci_imm; break;
+                case 0b11:
+                    if (cbits(half, 12, 12))
+                        break;
+                    d.rs2 = i.cs_type.rs2 + 8;
+                    switch (cbits(half, 6, 5))
+                    {
+                        case 0b00: d.op = OP_SUB; break;
+                        case 0b01: d.op = OP_XOR; break;
+                        case 0b10: d.op = OP_OR; break;
+                        case 0b11: d.op = OP_AND; break;
+                    }
+                    break;
+            }
+            break;
+        case 0b11001: // C.BEQZ -> beq rs1', x0, offset
+        case 0b11101: // C.BNEZ -> bne rs1', x0, offset
+            d.op = (i.cb_type.funct3 == 0b110) ? OP_BEQ : OP_BNE;
+            d.rs1 = rs1_c;
+            d.imm = sign_extend((cbits(half, 12, 12) << 8) | (cbits(half, 11, 10) << 3) | (cbits(half, 6, 5) << 6) |
+                                (cbits(half, 4, 3) << 1) | (cbits(half, 2, 2) << 5), 23);
+            break;
+
+        // Quadrant 2
+        case 0b00010: // C.SLLI -> slli rd, rd, shamt
+            if (!cbits(half, 12, 12))
+            {
+                d.op = OP_SLLI;
+                d.rd = rd_rs1;
+                d.rs1 = rd_rs1;
+                d.imm = cbits(half, 6, 2);
+            }
+            break;
+        case 0b01010: // C.LWSP -> lw rd, uimm(x2)
+            if (rd_rs1 != 0)
+            {
+                d.op = OP_LW;
+                d.rd = rd_rs1;
+                d.rs1 = 2;
+                d.imm = (cbits(half, 12, 12) << 5) | (cbits(half, 6, 4) << 2) | (cbits(half, 3, 2) << 6);
+            }
+            break;
+        case 0b10010:
+            {
+                uint8_t rs2 = i.cr_type.rs2;
+                bool bit12 = i.cr_type.funct4 & 1;
+                if (!bit12 && rs2 == 0 && rd_rs1 != 0) // C.JR -> jalr x0, 0(rs1)
+                {
+                    d.op = OP_JALR;
+                    d.rs1 = rd_rs1;
+                }
+                else if (!bit12 && rs2 != 0) // C.MV -> add rd, x0, rs2
+                {
+                    d.op = OP_ADD;
+                    d.rd = rd_rs1;
+                    d.rs2 = rs2;
+                }
+                else if (bit12 && rs2 == 0 && rd_rs1 == 0) // C.EBREAK
+                {
+                    d.op = OP_EBREAK;
+                }
+                else if (bit12 && rs2 == 0) // C.JALR -> jalr x1, 0(rs1)
+                {
+                    d.op = OP_JALR;
+                    d.rd = 1;
+                    d.rs1 = rd_rs1;
+                }
+                else if (bit12) // C.ADD -> add rd, rd, rs2
+                {
+                    d.op = OP_ADD;
+                    d.rd = rd_rs1;
+                    d.rs1 = rd_rs1;
+                    d.rs2 = rs2;
+                }
+            }
+            break;
+        case 0b11010: // C.SWSP -> sw rs2, uimm(x2)
+            d.op = OP_SW;
+            d.rs1 = 2;
+            d.rs2 = i.css_type.rs2;
+            d.imm = (cbits(half, 12, 9) << 2) | (cbits(half, 8, 7) << 6);
+            break;
+    }
+
+    return d;
+}
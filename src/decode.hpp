@@ -0,0 +1,74 @@
+#ifndef DECODE_HPP
+#define DECODE_HPP
+
+#include <cstdint>
+
+inline int32_t sign_extend(uint32_t a, uint8_t shift)
+{
+    return (int32_t)(a << shift) >> shift;
+}
+
+// Flat handler ids, one per mnemonic. OP_UNDECODED has to stay 0 so that
+// zeroed decode cache entries read as "not decoded yet".
+enum OPCODE : uint8_t
+{
+    OP_UNDECODED = 0,
+    // Anything that doesn't decode. There are no traps, so it retires as a no-op
+    OP_ILLEGAL,
+    // Integer ALU R-Type
+    OP_ADD, OP_SUB, OP_XOR, OP_OR, OP_AND, OP_SLL, OP_SRL, OP_SRA, OP_SLT, OP_SLTU,
+    // RV32M
+    OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU, OP_DIV, OP_DIVU, OP_REM, OP_REMU,
+    // Integer ALU I-Type
+    OP_ADDI, OP_XORI, OP_ORI, OP_ANDI, OP_SLLI, OP_SRLI, OP_SRAI, OP_SLTI, OP_SLTIU,
+    // Loads / Stores
+    OP_LB, OP_LH, OP_LW, OP_LBU, OP_LHU,
+    OP_SB, OP_SH, OP_SW,
+    // Branches / Jumps
+    OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+    OP_JAL, OP_JALR,
+    // Upper immediates
+    OP_LUI, OP_AUIPC,
+    // Environment
+    OP_ECALL, OP_EBREAK,
+    // Memory ordering
+    OP_FENCE, OP_FENCE_I,
+    // Zicsr, imm holds the CSR number and rs1 the immediate of the *I forms
+    OP_CSRRW, OP_CSRRS, OP_CSRRC, OP_CSRRWI, OP_CSRRSI, OP_CSRRCI,
+    // RV32A
+    OP_LR_W, OP_SC_W,
+    OP_AMOSWAP_W, OP_AMOADD_W, OP_AMOXOR_W, OP_AMOAND_W, OP_AMOOR_W,
+    OP_AMOMIN_W, OP_AMOMAX_W, OP_AMOMINU_W, OP_AMOMAXU_W,
+    // Fetch from outside guest memory, produced by decode_cache
+    OP_FETCH_FAULT,
+    // Block-internal micro-ops, never produced by decode_instr
+    OP_BLOCK_END, OP_NOP,
+    // Superinstructions, fused from the pair starting at this slot
+    OP_LUI_ADDI, OP_AUIPC_ADDI, OP_AUIPC_JALR, OP_AUIPC_LW, OP_ADDI_BNE,
+    OP_COUNT
+};
+
+// Compact record an instruction word is decoded into once. Register fields a
+// format doesn't have are left at 0. imm is always fully sign-extended; for
+// shifts it holds the shift amount and for LUI/AUIPC the already shifted
+// upper immediate. Compressed instructions decode to the record of their
+// 32-bit expansion, len tells them apart.
+struct decoded_instr
+{
+    uint8_t op;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    uint8_t len; // Instruction length in bytes, 2 or 4
+    int32_t imm;
+};
+
+decoded_instr decode_instr(uint32_t word);
+
+// RV32C: decodes a 16-bit instruction as the 32-bit one it expands to
+decoded_instr decode_compressed(uint16_t half);
+
+// Mnemonic of every op, spelled the way rv_pp_decode prints them
+extern const char* const op_names[OP_COUNT];
+
+#endif
@@ -0,0 +1,77 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+
+#include <fmt/core.h>
+
+#include "decode_cache.hpp"
+
+static const decoded_instr fault = { OP_FETCH_FAULT, 0, 0, 0, 4, 0 };
+
+decode_cache::decode_cache(const guest_memory& memory)
+    : memory(memory), fault_slot((memory.size() + 1) >> 1), table_bytes((fault_slot + 1) * sizeof(decoded_instr)),
+      code_pages(((memory.size() >> 12) + 63) / 64, 0)
+{
+    void* table = mmap(nullptr, table_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED)
+    {
+        fmt::print("Could not map decode cache\n");
+        std::abort();
+    }
+    entries = static_cast<decoded_instr*>(table);
+    entries[fault_slot] = fault;
+}
+
+void decode_cache::decode(decoded_instr& d, uint32_t pc)
+{
+    uint16_t low, high;
+    if (!memory.read16(pc, low))
+    {
+        d = fault;
+        return;
+    }
+    if ((low & 3) != 3)
+    {
+        d = decode_compressed(low);
+        mark_code_page(pc);
+        return;
+    }
+
+    // The upper half may be on the next page, both pages now hold code.
+    // Past the end of memory the fault is cached against pc's page, which
+    // a store there has to clear.
+    if (pc + 2 < pc || !memory.read16(pc + 2, high))
+    {
+        d = fault;
+        mark_code_page(pc);
+        return;
+    }
+    d = decode_instr(low | (uint32_t)high << 16);
+    mark_code_page(pc);
+    mark_code_page(pc + 2);
+}
+
+// Only the guest pages marked as code have anything decoded, so zeroing
+// their part of the table (OP_UNDECODED is 0) costs as much as the code the
+// program ran. Keeping those table pages means the next program to run
+// there doesn't fault them back in.
+void decode_cache::clear()
+{
+    for (std::size_t i = 0; i < code_pages.size(); i++)
+    {
+        for (uint64_t bits = code_pages[i]; bits; bits &= bits - 1)
+        {
+            // The last page may be cut short, the fault slot after it stays
+            uint64_t first = (i * 64 + __builtin_ctzll(bits)) * 2048;
+            std::memset(entries + first, 0, std::min<uint64_t>(2048, fault_slot - first) * sizeof(decoded_instr));
+        }
+        code_pages[i] = 0;
+    }
+}
+
+decode_cache::~decode_cache()
+{
+    munmap(entries, table_bytes);
+}
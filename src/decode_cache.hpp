@@ -0,0 +1,129 @@
+#ifndef DECODE_CACHE_HPP
+#define DECODE_CACHE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "decode.hpp"
+#include "memory.hpp"
+
+// One decoded_instr per 16-bit halfword of guest memory, since with RV32C an
+// instruction may start at any of them. The table is an anonymous mapping,
+// so only pages that actually hold executed code are ever backed, and
+// untouched entries read as OP_UNDECODED. Instructions reaching outside
+// guest memory decode to OP_FETCH_FAULT; every pc past the end shares one
+// such entry after the table. A bitmap of guest pages that have had
+// anything decoded keeps stores to data pages off the table.
+class decode_cache
+{
+public:
+    explicit decode_cache(const guest_memory& memory);
+    ~decode_cache();
+
+    decode_cache(const decode_cache&) = delete;
+    decode_cache& operator=(const decode_cache&) = delete;
+
+    // Decoded form of the instruction at pc, decoding it on first use
+    const decoded_instr& fetch(uint32_t pc)
+    {
+        decoded_instr& d = entries[index(pc)];
+        if (d.op == OP_UNDECODED) [[unlikely]]
+            decode(d, pc);
+        return d;
+    }
+
+    // The same without the range check, for a pc in_table
+    const decoded_instr& sequential_fetch(uint32_t pc)
+    {
+        decoded_instr& d = entries[pc >> 1];
+        if (d.op == OP_UNDECODED) [[unlikely]]
+            decode(d, pc);
+        return d;
+    }
+
+    // Cache slot for pc without decoding, op is OP_UNDECODED on a miss
+    const decoded_instr& slot(uint32_t pc) const
+    {
+        return entries[index(pc)];
+    }
+
+    // The same without the range check, for a pc reached by stepping past
+    // an instruction that decoded. That can be at most the end of memory,
+    // whose slot is the fault entry.
+    const decoded_instr& sequential_slot(uint32_t pc) const
+    {
+        return entries[pc >> 1];
+    }
+
+    // Whether pc indexes the table itself, which stepping past an
+    // instruction that decoded can't leave
+    bool in_table(uint32_t pc) const
+    {
+        return (pc >> 1) <= fault_slot;
+    }
+
+    const uint64_t* code_page_bitmap() const
+    {
+        return code_pages.data();
+    }
+
+    bool is_code_page(uint32_t addr) const
+    {
+        return code_pages[addr >> 18] & (1ull << ((addr >> 12) & 63));
+    }
+
+    // Drop cached decodes overlapping [addr, addr + len), called on every store.
+    // Returns true if a decoded instruction was actually overwritten.
+    bool invalidate(uint32_t addr, uint32_t len)
+    {
+        if (!is_code_page(addr) && !is_code_page(addr + len - 1)) [[likely]]
+            return false;
+
+        // A 32-bit instruction starting in the halfword before addr overlaps it
+        bool hit = false;
+        uint32_t first = addr >> 1;
+        if (first > 0 && entries[first - 1].op != OP_UNDECODED && entries[first - 1].len == 4)
+        {
+            entries[first - 1].op = OP_UNDECODED;
+            hit = true;
+        }
+        for (uint32_t h = first; h <= (addr + len - 1) >> 1; h++)
+        {
+            if (entries[h].op != OP_UNDECODED)
+            {
+                entries[h].op = OP_UNDECODED;
+                hit = true;
+            }
+        }
+        return hit;
+    }
+
+    // Drop every cached decode
+    void clear();
+
+private:
+    void decode(decoded_instr& d, uint32_t pc);
+
+    uint64_t index(uint32_t pc) const
+    {
+        if ((pc >> 1) > fault_slot) [[unlikely]]
+            return fault_slot;
+        return pc >> 1;
+    }
+
+    void mark_code_page(uint32_t addr)
+    {
+        code_pages[addr >> 18] |= 1ull << ((addr >> 12) & 63);
+    }
+
+    const guest_memory& memory;
+    decoded_instr* entries;
+    // Index of the entry standing for every pc outside memory. 64-bit so the
+    // cores' stores to uint32_t registers can't alias it and force a reload.
+    uint64_t fault_slot;
+    uint64_t table_bytes;
+    std::vector<uint64_t> code_pages;
+};
+
+#endif
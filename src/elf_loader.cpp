@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <elf.h>
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#include "elf_loader.hpp"
+
+namespace
+{
+
+const uint64_t PAGE_SIZE = 4096;
+
+bool read_at(int fd, void* out, uint64_t len, uint64_t offset)
+{
+    uint8_t* at = static_cast<uint8_t*>(out);
+    while (len > 0)
+    {
+        ssize_t got = pread(fd, at, len, offset);
+        if (got <= 0)
+            return false;
+        at += got;
+        len -= got;
+        offset += got;
+    }
+    return true;
+}
+
+// loaded_end is the end of the last guest page written by earlier segments,
+// which may share their final page with this one
+bool load_segment(int fd, guest_memory& memory, const Elf32_Phdr& ph, uint64_t& loaded_end)
+{
+    uint64_t vaddr = ph.p_vaddr;
+    uint64_t file_end = vaddr + ph.p_filesz;
+    uint64_t copy_end = vaddr;
+
+    if (ph.p_filesz > 0 && (ph.p_offset % PAGE_SIZE) == (vaddr % PAGE_SIZE))
+    {
+        // Copy the part of a page already holding an earlier segment, map the rest
+        uint64_t map_start = vaddr & ~(PAGE_SIZE - 1);
+        if (map_start < loaded_end)
+            map_start = (vaddr | (PAGE_SIZE - 1)) + 1;
+        copy_end = std::min(map_start, file_end);
+
+        if (map_start < file_end)
+        {
+            uint64_t offset = ph.p_offset + map_start - vaddr;
+            if (!memory.map_file(fd, offset, map_start, file_end - map_start))
+                return false;
+
+            // The mapped tail page carries whatever follows in the file
+            uint64_t page_end = ((file_end - 1) | (PAGE_SIZE - 1)) + 1;
+            std::memset(memory.data() + file_end, 0, page_end - file_end);
+        }
+    }
+    else
+        copy_end = file_end;
+
+    if (copy_end > vaddr && !read_at(fd, memory.data() + vaddr, copy_end - vaddr, ph.p_offset))
+        return false;
+
+    loaded_end = std::max(loaded_end, ((vaddr + ph.p_memsz - 1) | (PAGE_SIZE - 1)) + 1);
+    return true;
+}
+
+void read_symbols(int fd, const Elf32_Ehdr& eh, elf_image& image)
+{
+    if (eh.e_shoff == 0 || eh.e_shentsize != sizeof(Elf32_Shdr))
+        return;
+
+    std::vector<Elf32_Shdr> sections(eh.e_shnum);
+    if (!read_at(fd, sections.data(), sections.size() * sizeof(Elf32_Shdr), eh.e_shoff))
+        return;
+
+    for (const Elf32_Shdr& sh : sections)
+    {
+        if (sh.sh_type != SHT_SYMTAB || sh.sh_link >= sections.size())
+            continue;
+
+        const Elf32_Shdr& strtab = sections[sh.sh_link];
+        std::vector<Elf32_Sym> syms(sh.sh_size / sizeof(Elf32_Sym));
+        std::vector<char> names(strtab.sh_size + 1, 0);
+        if (!read_at(fd, syms.data(), syms.size() * sizeof(Elf32_Sym), sh.sh_offset) ||
+            !read_at(fd, names.data(), strtab.sh_size, strtab.sh_offset))
+            return;
+
+        for (const Elf32_Sym& s : syms)
+        {
+            uint8_t type = ELF32_ST_TYPE(s.st_info);
+            if (s.st_shndx == SHN_UNDEF || s.st_name == 0 || s.st_name >= strtab.sh_size)
+                continue;
+            if (type != STT_FUNC && type != STT_OBJECT && type != STT_NOTYPE)
+                continue;
+            // Assembler temporaries (.Lpcrel_hi0 and the like) only get in the way
+            if (std::strncmp(names.data() + s.st_name, ".L", 2) == 0)
+                continue;
+            image.symbols.push_back({ s.st_value, s.st_size, names.data() + s.st_name });
+        }
+    }
+
+    std::sort(image.symbols.begin(), image.symbols.end(),
+              [](const elf_symbol& a, const elf_symbol& b) { return a.addr < b.addr; });
+}
+
+}
+
+const elf_symbol* elf_image::symbol_at(uint32_t addr) const
+{
+    auto it = std::upper_bound(symbols.begin(), symbols.end(), addr,
+                               [](uint32_t a, const elf_symbol& s) { return a < s.addr; });
+    if (it == symbols.begin())
+        return nullptr;
+    return &*(it - 1);
+}
+
+bool is_elf(int fd)
+{
+    unsigned char magic[SELFMAG];
+    return read_at(fd, magic, SELFMAG, 0) && std::memcmp(magic, ELFMAG, SELFMAG) == 0;
+}
+
+bool load_elf(int fd, guest_memory& memory, elf_image& image, std::string& error)
+{
+    Elf32_Ehdr eh;
+    if (!read_at(fd, &eh, sizeof(eh), 0))
+    {
+        error = "ELF header is truncated";
+        return false;
+    }
+
+    if (eh.e_ident[EI_CLASS] != ELFCLASS32 || eh.e_ident[EI_DATA] != ELFDATA2LSB || eh.e_machine != EM_RISCV)
+    {
+        error = "Not a 32-bit little endian RISC-V ELF file";
+        return false;
+    }
+
+    if (eh.e_type != ET_EXEC || eh.e_phentsize != sizeof(Elf32_Phdr))
+    {
+        error = "Only statically linked ELF executables are supported";
+        return false;
+    }
+
+    std::vector<Elf32_Phdr> segments(eh.e_phnum);
+    if (!read_at(fd, segments.data(), segments.size() * sizeof(Elf32_Phdr), eh.e_phoff))
+    {
+        error = "ELF program headers are truncated";
+        return false;
+    }
+
+    std::sort(segments.begin(), segments.end(),
+              [](const Elf32_Phdr& a, const Elf32_Phdr& b) { return a.p_vaddr < b.p_vaddr; });
+
+    uint64_t loaded_end = 0;
+    for (const Elf32_Phdr& ph : segments)
+    {
+        if (ph.p_type != PT_LOAD || ph.p_memsz == 0)
+            continue;
+
+        if (ph.p_filesz > ph.p_memsz || (uint64_t)ph.p_vaddr + ph.p_memsz > memory.size())
+        {
+            error = fmt::format("ELF segment at {:08x} does not fit in RISCV memory", ph.p_vaddr);
+            return false;
+        }
+
+        if (!load_segment(fd, memory, ph, loaded_end))
+        {
+            error = fmt::format("Could not load ELF segment at {:08x}", ph.p_vaddr);
+            return false;
+        }
+    }
+
+    image.entry = eh.e_entry;
+    image.end = loaded_end;
+    read_symbols(fd, eh, image);
+    return true;
+}
@@ -0,0 +1,38 @@
+#ifndef ELF_LOADER_HPP
+#define ELF_LOADER_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "memory.hpp"
+
+struct elf_symbol
+{
+    uint32_t addr;
+    uint32_t size;
+    std::string name;
+};
+
+// What the loader keeps from an ELF file once its segments are in memory
+struct elf_image
+{
+    uint32_t entry = 0;
+    uint32_t end = 0;                // End of the highest segment in memory
+    std::vector<elf_symbol> symbols; // Sorted by addr
+
+    // Symbol covering addr, or the closest one below it, nullptr if none
+    const elf_symbol* symbol_at(uint32_t addr) const;
+};
+
+// True if fd starts with the ELF magic
+bool is_elf(int fd);
+
+// Place the PT_LOAD segments of a 32-bit little endian RISC-V executable at
+// their vaddr and read its symbol table. Segments whose file offset and vaddr
+// agree modulo the page size are mapped copy on write, others are copied;
+// .bss is left to the zero pages of guest memory. Returns false with the
+// reason in error on a malformed or unsupported file.
+bool load_elf(int fd, guest_memory& memory, elf_image& image, std::string& error);
+
+#endif
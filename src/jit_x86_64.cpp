@@ -0,0 +1,415 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <sys/mman.h>
+
+#include "jit_x86_64.hpp"
+
+// Size of the executable code buffer
+static const std::size_t CODE_BUFFER_SIZE = 16 << 20;
+
+// Worst case bytes emitted for one micro-op plus its bail stub
+static const std::size_t MAX_OP_BYTES = 96;
+
+static const int32_t PC_OFFSET = offsetof(cpu_state, pc_reg);
+
+// Host registers, by their x86 encoding
+enum host_reg : uint8_t
+{
+    EAX = 0,
+    ECX = 1,
+    EDX = 2,
+    ESI = 6
+};
+
+namespace
+{
+
+// Byte emitter over the part of the code buffer one block is written into
+struct emitter
+{
+    uint8_t* at;
+
+    void byte(uint8_t b) { *at++ = b; }
+    void bytes(std::initializer_list<uint8_t> bs) { for (uint8_t b : bs) *at++ = b; }
+    void imm32(uint32_t v) { std::memcpy(at, &v, sizeof(v)); at += sizeof(v); }
+
+    // mov r32, guest x[r] (xor r32, r32 for x0)
+    void load_reg(host_reg dst, uint8_t r)
+    {
+        if (r == 0)
+            bytes({ 0x31, (uint8_t)(0xC0 | (dst << 3) | dst) });
+        else
+            bytes({ 0x8B, (uint8_t)(0x43 | (dst << 3)), (uint8_t)(r * 4) });
+    }
+
+    // mov guest x[r], r32
+    void store_reg(uint8_t r, host_reg src)
+    {
+        bytes({ 0x89, (uint8_t)(0x43 | (src << 3)), (uint8_t)(r * 4) });
+    }
+
+    // mov dword guest x[r], imm32
+    void store_reg_imm(uint8_t r, uint32_t v)
+    {
+        bytes({ 0xC7, 0x43, (uint8_t)(r * 4) });
+        imm32(v);
+    }
+
+    // mov dword [rbx + pc_reg], r32 / imm32
+    void store_pc(host_reg src)
+    {
+        bytes({ 0x89, (uint8_t)(0x83 | (src << 3)) });
+        imm32(PC_OFFSET);
+    }
+    void store_pc_imm(uint32_t v)
+    {
+        bytes({ 0xC7, 0x83 });
+        imm32(PC_OFFSET);
+        imm32(v);
+    }
+
+    // <alu> eax, ecx using the "r/m32, r32" opcode
+    void alu_rr(uint8_t opcode) { bytes({ opcode, 0xC8 }); }
+
+    // <alu> eax, imm32 using the 0x81 group
+    void alu_ri(uint8_t ext, uint32_t v)
+    {
+        bytes({ 0x81, (uint8_t)(0xC0 | (ext << 3)) });
+        imm32(v);
+    }
+
+    // setcc al ; movzx eax, al
+    void set_flag(uint8_t cc) { bytes({ 0x0F, cc, 0xC0, 0x0F, 0xB6, 0xC0 }); }
+
+    // mov r32, imm32
+    void mov_imm(host_reg dst, uint32_t v)
+    {
+        byte(0xB8 + dst);
+        imm32(v);
+    }
+
+    // jcc rel32 to be patched later, returns the offset field
+    uint8_t* jcc(uint8_t cc)
+    {
+        bytes({ 0x0F, cc });
+        uint8_t* field = at;
+        imm32(0);
+        return field;
+    }
+
+    uint8_t* jmp()
+    {
+        byte(0xE9);
+        uint8_t* field = at;
+        imm32(0);
+        return field;
+    }
+};
+
+void patch(uint8_t* field, const uint8_t* target)
+{
+    int32_t rel = (int32_t)(target - (field + 4));
+    std::memcpy(field, &rel, sizeof(rel));
+}
+
+bool is_load(uint8_t op)
+{
+    return op == OP_LB || op == OP_LH || op == OP_LW || op == OP_LBU || op == OP_LHU;
+}
+
+uint32_t access_width(uint8_t op)
+{
+    switch (op)
+    {
+        case OP_LB: case OP_LBU: case OP_SB: return 1;
+        case OP_LH: case OP_LHU: case OP_SH: return 2;
+        default: return 4;
+    }
+}
+
+bool is_store(uint8_t op)
+{
+    return op == OP_SB || op == OP_SH || op == OP_SW;
+}
+
+// Emitted a sequence the native code handles, false if the op must bail
+bool emit_op(emitter& e, const block& b, const decoded_instr& d)
+{
+    switch (d.op)
+    {
+        case OP_NOP:
+        case OP_ILLEGAL:
+            return true;
+
+        // Integer ALU R-Type: eax = rs1, ecx = rs2
+        case OP_ADD: case OP_SUB: case OP_XOR: case OP_OR: case OP_AND:
+        case OP_SLL: case OP_SRL: case OP_SRA: case OP_SLT: case OP_SLTU:
+            e.load_reg(EAX, d.rs1);
+            e.load_reg(ECX, d.rs2);
+            switch (d.op)
+            {
+                case OP_ADD:  e.alu_rr(0x01); break;
+                case OP_SUB:  e.alu_rr(0x29); break;
+                case OP_XOR:  e.alu_rr(0x31); break;
+                case OP_OR:   e.alu_rr(0x09); break;
+                case OP_AND:  e.alu_rr(0x21); break;
+                // x86 masks 32-bit shift counts to 5 bits, same as RV32I
+                case OP_SLL:  e.bytes({ 0xD3, 0xE0 }); break;
+                case OP_SRL:  e.bytes({ 0xD3, 0xE8 }); break;
+                case OP_SRA:  e.bytes({ 0xD3, 0xF8 }); break;
+                case OP_SLT:  e.alu_rr(0x39); e.set_flag(0x9C); break;
+                case OP_SLTU: e.alu_rr(0x39); e.set_flag(0x92); break;
+            }
+            e.store_reg(d.rd, EAX);
+            return true;
+
+        // RV32M multiplies, the high halves come out of a widening multiply
+        case OP_MUL: case OP_MULH: case OP_MULHSU: case OP_MULHU:
+            e.load_reg(EAX, d.rs1);
+            e.load_reg(ECX, d.rs2);
+            switch (d.op)
+            {
+                case OP_MUL:   e.bytes({ 0x0F, 0xAF, 0xC1 }); break; // imul eax, ecx
+                case OP_MULH:  e.bytes({ 0xF7, 0xE9, 0x89, 0xD0 }); break; // imul ecx ; mov eax, edx
+                case OP_MULHU: e.bytes({ 0xF7, 0xE1, 0x89, 0xD0 }); break; // mul ecx ; mov eax, edx
+                case OP_MULHSU:
+                    e.bytes({ 0x48, 0x63, 0xC0 });       // movsxd rax, eax
+                    e.bytes({ 0x48, 0x0F, 0xAF, 0xC1 }); // imul rax, rcx (rcx is zero-extended)
+                    e.bytes({ 0x48, 0xC1, 0xE8, 0x20 }); // shr rax, 32
+                    break;
+            }
+            e.store_reg(d.rd, EAX);
+            return true;
+
+        // RV32M divides: quotient in eax, remainder in edx. Division by zero
+        // and INT32_MIN / -1 are branched around, x86 would trap on both.
+        case OP_DIV: case OP_DIVU: case OP_REM: case OP_REMU:
+            {
+                bool is_signed = d.op == OP_DIV || d.op == OP_REM;
+                bool is_rem = d.op == OP_REM || d.op == OP_REMU;
+                e.load_reg(EAX, d.rs1);
+                e.load_reg(ECX, d.rs2);
+                e.bytes({ 0x85, 0xC9 });                          // test ecx, ecx
+                uint8_t* by_zero = e.jcc(0x84);
+                uint8_t* overflow_checked[2] = { nullptr, nullptr };
+                if (is_signed)
+                {
+                    e.bytes({ 0x83, 0xF9, 0xFF });                // cmp ecx, -1
+                    overflow_checked[0] = e.jcc(0x85);
+                    e.bytes({ 0x3D, 0x00, 0x00, 0x00, 0x80 });    // cmp eax, INT32_MIN
+                    overflow_checked[1] = e.jcc(0x85);
+                    // Overflow: quotient is INT32_MIN (already in eax), remainder 0
+                    e.bytes({ 0x31, 0xD2 });                      // xor edx, edx
+                }
+                uint8_t* skip_divide = is_signed ? e.jmp() : nullptr;
+                for (uint8_t* field : overflow_checked)
+                    if (field)
+                        patch(field, e.at);
+                if (is_signed)
+                    e.bytes({ 0x99, 0xF7, 0xF9 });                // cdq ; idiv ecx
+                else
+                    e.bytes({ 0x31, 0xD2, 0xF7, 0xF1 });          // xor edx, edx ; div ecx
+                uint8_t* done = e.jmp();
+                patch(by_zero, e.at);
+                e.bytes({ 0x89, 0xC2 });                          // mov edx, eax (remainder = rs1)
+                e.mov_imm(EAX, UINT32_MAX);                       // quotient = -1
+                patch(done, e.at);
+                if (skip_divide)
+                    patch(skip_divide, e.at);
+                e.store_reg(d.rd, is_rem ? EDX : EAX);
+            }
+            return true;
+
+        // Integer ALU I-Type
+        case OP_ADDI: case OP_XORI: case OP_ORI: case OP_ANDI:
+        case OP_SLLI: case OP_SRLI: case OP_SRAI: case OP_SLTI: case OP_SLTIU:
+            e.load_reg(EAX, d.rs1);
+            switch (d.op)
+            {
+                case OP_ADDI:  e.alu_ri(0, d.imm); break;
+                case OP_XORI:  e.alu_ri(6, d.imm); break;
+                case OP_ORI:   e.alu_ri(1, d.imm); break;
+                case OP_ANDI:  e.alu_ri(4, d.imm); break;
+                case OP_SLLI:  e.bytes({ 0xC1, 0xE0, (uint8_t)d.imm }); break;
+                case OP_SRLI:  e.bytes({ 0xC1, 0xE8, (uint8_t)d.imm }); break;
+                case OP_SRAI:  e.bytes({ 0xC1, 0xF8, (uint8_t)d.imm }); break;
+                case OP_SLTI:  e.alu_ri(7, d.imm); e.set_flag(0x9C); break;
+                case OP_SLTIU: e.alu_ri(7, d.imm); e.set_flag(0x92); break;
+            }
+            e.store_reg(d.rd, EAX);
+            return true;
+
+        case OP_LUI:
+            e.store_reg_imm(d.rd, d.imm);
+            return true;
+
+        // Integer Branch B-Type: cmov the taken target over the fall-through
+        case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+            {
+                uint8_t cmov = 0;
+                switch (d.op)
+                {
+                    case OP_BEQ:  cmov = 0x44; break;
+                    case OP_BNE:  cmov = 0x45; break;
+                    case OP_BLT:  cmov = 0x4C; break;
+                    case OP_BGE:  cmov = 0x4D; break;
+                    case OP_BLTU: cmov = 0x42; break;
+                    case OP_BGEU: cmov = 0x43; break;
+                }
+                e.load_reg(EAX, d.rs1);
+                e.load_reg(ECX, d.rs2);
+                e.alu_rr(0x39);
+                e.mov_imm(EAX, b.end_pc);
+                e.mov_imm(EDX, d.imm);
+                e.bytes({ 0x0F, cmov, 0xC2 });
+                e.store_pc(EAX);
+            }
+            return true;
+
+        case OP_JAL:
+            if (d.rd != 0)
+                e.store_reg_imm(d.rd, b.end_pc);
+            e.store_pc_imm(d.imm);
+            return true;
+
+        case OP_JALR:
+            e.load_reg(EAX, d.rs1);
+            e.alu_ri(0, d.imm);
+            e.bytes({ 0x83, 0xE0, 0xFE }); // and eax, ~1
+            if (d.rd != 0)
+                e.store_reg_imm(d.rd, b.end_pc);
+            e.store_pc(EAX);
+            return true;
+
+        case OP_BLOCK_END:
+            e.store_pc_imm(b.end_pc);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+}
+
+jit_x86_64::jit_x86_64()
+{
+    void* mem = mmap(nullptr, CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buffer = (mem == MAP_FAILED) ? nullptr : static_cast<uint8_t*>(mem);
+}
+
+jit_x86_64::~jit_x86_64()
+{
+    if (buffer)
+        munmap(buffer, CODE_BUFFER_SIZE);
+}
+
+native_fn jit_x86_64::compile(const block& b, uint64_t memory_size)
+{
+    if (!buffer || CODE_BUFFER_SIZE - used < (b.ops.size() + 2) * MAX_OP_BYTES)
+        return nullptr;
+
+    uint8_t* start = buffer + used;
+    emitter e { start };
+
+    // Prologue: rbx = cpu, r12 = memory, r13 = code page bitmap
+    e.bytes({ 0x53, 0x41, 0x54, 0x41, 0x55 });
+    e.bytes({ 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4, 0x49, 0x89, 0xD5 });
+
+    // Jumps to "return index i" stubs, emitted after the body
+    std::vector<std::pair<uint8_t*, uint32_t>> bails;
+
+    uint32_t i = 0;
+    for (; i < b.ops.size(); i++)
+    {
+        // Fused pairs are compiled as their two original instructions
+        decoded_instr d = b.ops[i];
+        d.op = unfused_op(d.op);
+
+        // Accesses running past the end of guest memory bail so the
+        // interpreter raises the fault: cmp eax, size - width ; ja bail
+        auto bounds_check = [&]()
+        {
+            uint64_t limit = std::min<uint64_t>(memory_size, 1ull << 32) - access_width(d.op);
+            if (limit == UINT32_MAX)
+                return;
+            e.alu_ri(7, (uint32_t)limit);
+            bails.push_back({ e.jcc(0x87), i });
+        };
+
+        // Integer Load I-Type: eax = address, ecx = [r12 + rax]
+        if (is_load(d.op))
+        {
+            e.load_reg(EAX, d.rs1);
+            e.alu_ri(0, d.imm);
+            bounds_check();
+            switch (d.op)
+            {
+                case OP_LB:  e.bytes({ 0x41, 0x0F, 0xBE, 0x0C, 0x04 }); break;
+                case OP_LH:  e.bytes({ 0x41, 0x0F, 0xBF, 0x0C, 0x04 }); break;
+                case OP_LW:  e.bytes({ 0x41, 0x8B, 0x0C, 0x04 }); break;
+                case OP_LBU: e.bytes({ 0x41, 0x0F, 0xB6, 0x0C, 0x04 }); break;
+                case OP_LHU: e.bytes({ 0x41, 0x0F, 0xB7, 0x0C, 0x04 }); break;
+            }
+            if (d.rd != 0)
+                e.store_reg(d.rd, ECX);
+            continue;
+        }
+
+        if (is_store(d.op))
+        {
+            uint32_t align = (d.op == OP_SB) ? 0 : (d.op == OP_SH) ? 1 : 3;
+
+            // eax = address, ecx = value
+            e.load_reg(EAX, d.rs1);
+            e.alu_ri(0, d.imm);
+            bounds_check();
+            e.load_reg(ECX, d.rs2);
+
+            // Misaligned stores bail, so aligned ones never straddle a page
+            if (align)
+            {
+                e.bytes({ 0xA8, (uint8_t)align }); // test al, align
+                bails.push_back({ e.jcc(0x85), i });
+            }
+
+            // Stores into pages with decoded code bail so the interpreter
+            // can invalidate: bt [r13 + (addr >> 18) * 8], (addr >> 12) & 63
+            e.bytes({ 0x89, 0xC2, 0xC1, 0xEA, 0x12 });           // mov edx, eax ; shr edx, 18
+            e.bytes({ 0x49, 0x8B, 0x54, 0xD5, 0x00 });           // mov rdx, [r13 + rdx * 8]
+            e.bytes({ 0x89, 0xC6, 0xC1, 0xEE, 0x0C });           // mov esi, eax ; shr esi, 12
+            e.bytes({ 0x48, 0x0F, 0xA3, 0xF2 });                 // bt rdx, rsi
+            bails.push_back({ e.jcc(0x82), i });
+
+            switch (d.op)
+            {
+                case OP_SB: e.bytes({ 0x41, 0x88, 0x0C, 0x04 }); break;
+                case OP_SH: e.bytes({ 0x66, 0x41, 0x89, 0x0C, 0x04 }); break;
+                case OP_SW: e.bytes({ 0x41, 0x89, 0x0C, 0x04 }); break;
+            }
+            continue;
+        }
+
+        if (!emit_op(e, b, d))
+            break;
+    }
+
+    // Falls through here with i == ops.size() once the terminator has set
+    // pc_reg, or with i at the first op left to the interpreter
+    e.mov_imm(EAX, i);
+    uint8_t* epilogue = e.at;
+    e.bytes({ 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 });
+
+    for (auto& [field, index] : bails)
+    {
+        patch(field, e.at);
+        e.mov_imm(EAX, index);
+        patch(e.jmp(), epilogue);
+    }
+
+    used += e.at - start;
+    return reinterpret_cast<native_fn>(start);
+}
@@ -0,0 +1,41 @@
+#ifndef JIT_X86_64_HPP
+#define JIT_X86_64_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "block.hpp"
+
+// x86-64 backend for hot blocks. Guest registers stay in the cpu_state
+// struct, which is pinned in rbx for the whole block; guest memory is based
+// at r12 and the decode cache's code page bitmap at r13.
+//
+// Anything the native code doesn't handle (ECALL/EBREAK, misaligned stores,
+// stores into pages holding decoded code, accesses past the end of guest
+// memory) bails out: the native function
+// returns the index of the first micro-op it did not execute, and the
+// interpreter carries on from there. x0 is never written by native code.
+class jit_x86_64
+{
+public:
+    jit_x86_64();
+    ~jit_x86_64();
+
+    jit_x86_64(const jit_x86_64&) = delete;
+    jit_x86_64& operator=(const jit_x86_64&) = delete;
+
+    // Native code for b, or nullptr if the code buffer is full (see reset)
+    // or could not be mapped at all
+    native_fn compile(const block& b, uint64_t memory_size);
+
+    // Throw away all generated code. Every native_fn handed out is dead.
+    void reset() { used = 0; }
+
+    bool available() const { return buffer != nullptr; }
+
+private:
+    uint8_t* buffer;
+    std::size_t used = 0;
+};
+
+#endif
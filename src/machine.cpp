@@ -0,0 +1,326 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#include "machine.hpp"
+
+hart::hart(guest_memory& memory, syscall_proxy& syscalls, core_kind core, uint32_t id)
+    : memory(memory), syscalls(syscalls), icache(memory), bcache(icache, memory), core(core)
+{
+    cpu.hart_id = id;
+}
+
+exit_reason hart::run(uint64_t max_instructions)
+{
+    uint64_t limit = cpu.instret + max_instructions;
+    if (limit < cpu.instret)
+        limit = UINT64_MAX;
+
+    exit_reason reason;
+    for (;;)
+    {
+        if (trace)
+        {
+            reason = run_switch_traced(cpu, memory, icache, limit, *trace);
+        }
+        else
+        {
+            switch (core)
+            {
+                case CORE_SWITCH:   reason = run_switch(cpu, memory, icache, limit); break;
+                case CORE_THREADED: reason = run_threaded(cpu, memory, icache, limit); break;
+                default:            reason = run_blocks(cpu, memory, icache, bcache, limit); break;
+            }
+        }
+        if (reason != EXIT_ECALL)
+            break;
+        if (!syscalls.handle(*this))
+        {
+            reason = EXIT_EXITED;
+            break;
+        }
+    }
+
+    if (reason == EXIT_INTERRUPTED)
+        clear_interrupt(cpu);
+    // The program has stopped, show what it printed
+    else if (reason != EXIT_LIMIT)
+        syscalls.flush();
+    return reason;
+}
+
+void hart::reset(uint32_t pc)
+{
+    uint32_t id = cpu.hart_id;
+    cpu = cpu_state();
+    cpu.hart_id = id;
+    cpu.gp_regs[10] = id;
+    cpu.pc_reg = pc;
+    cpu.time_origin = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void hart::invalidate(uint32_t addr, uint64_t len)
+{
+    // A page at a time, the decode cache only checks the ends of a range
+    uint64_t end = (uint64_t)addr + len;
+    for (uint64_t at = addr; at < end; at = (at | 4095) + 1)
+    {
+        uint32_t chunk = std::min(end, (at | 4095) + 1) - at;
+        if (icache.invalidate(at, chunk))
+            bcache.invalidate(at, chunk);
+    }
+    bcache.collect();
+}
+
+void hart::invalidate_all()
+{
+    icache.clear();
+    bcache.clear();
+}
+
+machine::machine(uint64_t memory_size, core_kind core, uint32_t hart_count)
+    : mem(memory_size), sys(mem)
+{
+    // Returning to ra = 0 stops the program until something is loaded over it
+    mem.write32(0, 0x00100073);
+    for (uint32_t i = 0; i < std::max(hart_count, 1u); i++)
+        harts.push_back(std::make_unique<hart>(mem, sys, core, i));
+    reset();
+}
+
+// ELF executables are placed by their program headers and start at e_entry.
+// Anything else is a raw image mapped straight into guest memory at 0,
+// private so the first store to a page copies it and the file itself is
+// never written.
+bool machine::load(const char* path)
+{
+    std::string error;
+    if (load(path, error))
+        return true;
+    fmt::print("{}\n", error);
+    return false;
+}
+
+bool machine::load(const char* path, std::string& error)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        error = "File does not exist or could not be opened";
+        return false;
+    }
+
+    bool loaded;
+    elf = elf_image();
+    if (is_elf(fd))
+    {
+        loaded = load_elf(fd, mem, elf, error);
+        image_end = elf.end;
+    }
+    else if ((uint64_t)st.st_size > mem.size())
+    {
+        error = "Input file size larger than RISCV memory";
+        loaded = false;
+    }
+    else
+    {
+        loaded = mem.map_file(fd, 0, 0, st.st_size);
+        image_end = st.st_size;
+        if (!loaded)
+            error = "Could not map input file into RISCV memory";
+    }
+    close(fd);
+
+    if (!loaded)
+        return false;
+
+    // Drop anything decoded from what was there before
+    for (auto& h : harts)
+        h->invalidate_all();
+    entry_pc = elf.entry;
+    reset();
+    return true;
+}
+
+bool machine::load(const void* image, uint64_t len, uint32_t addr)
+{
+    if (!write(addr, image, len))
+        return false;
+    elf = elf_image();
+    entry_pc = addr;
+    image_end = addr + len;
+    reset();
+    return true;
+}
+
+void machine::clear()
+{
+    mem.clear();
+    mem.write32(0, 0x00100073); // EBREAK at 0, as the constructor leaves it
+    for (auto& h : harts)
+        h->invalidate_all();
+    elf = elf_image();
+    entry_pc = 0;
+    image_end = 0;
+    reset();
+}
+
+void machine::reset()
+{
+    for (auto& h : harts)
+        h->reset(entry_pc);
+    sys.reset(image_end);
+}
+
+// Interrupts the machine if it's still running when timeout has passed. A
+// timeout of 0 is none.
+class watchdog
+{
+public:
+    watchdog(machine& vm, std::chrono::nanoseconds timeout)
+        : vm(vm)
+    {
+        if (timeout.count() > 0)
+            thread = std::thread([this, timeout]() { wait(timeout); });
+    }
+
+    ~watchdog()
+    {
+        if (!thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopped = true;
+            changed.notify_all();
+        }
+        thread.join();
+        // Harts that stopped on their own just before it went off still
+        // have the interrupt pending
+        if (fired)
+        {
+            for (uint32_t i = 0; i < vm.hart_count(); i++)
+                clear_interrupt(vm.hart_at(i).state());
+        }
+    }
+
+private:
+    void wait(std::chrono::nanoseconds timeout)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        if (!changed.wait_for(guard, timeout, [this]() { return stopped; }))
+        {
+            vm.interrupt();
+            fired = true;
+        }
+    }
+
+    machine& vm;
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable changed;
+    bool stopped = false;
+    bool fired = false;
+};
+
+std::vector<exit_reason> machine::run(uint64_t max_instructions, std::chrono::nanoseconds timeout)
+{
+    watchdog guard(*this, timeout);
+    std::vector<exit_reason> reasons(harts.size());
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < harts.size(); i++)
+        threads.emplace_back([&, i]() { reasons[i] = run_hart(*harts[i], max_instructions); });
+
+    reasons[0] = run_hart(*harts[0], max_instructions);
+    for (std::thread& t : threads)
+        t.join();
+    return reasons;
+}
+
+std::vector<exit_reason> machine::run_interleaved(uint64_t quantum, uint64_t max_instructions, std::chrono::nanoseconds timeout)
+{
+    watchdog guard(*this, timeout);
+    quantum = std::max<uint64_t>(quantum, 1);
+    std::vector<exit_reason> reasons(harts.size(), EXIT_LIMIT);
+    std::vector<uint64_t> left(harts.size(), max_instructions);
+    for (bool running = true; running;)
+    {
+        running = false;
+        for (std::size_t i = 0; i < harts.size(); i++)
+        {
+            if (reasons[i] != EXIT_LIMIT || left[i] == 0)
+                continue;
+            uint64_t slice = std::min(quantum, left[i]);
+            reasons[i] = run_hart(*harts[i], slice);
+            left[i] -= slice;
+            running |= reasons[i] == EXIT_LIMIT && left[i] > 0;
+        }
+    }
+    return reasons;
+}
+
+void machine::interrupt()
+{
+    for (auto& h : harts)
+        h->interrupt();
+}
+
+// With a profiler, a hart runs in slices of its period and is sampled
+// in between
+exit_reason machine::run_hart(hart& h, uint64_t max_instructions)
+{
+    if (!sampler)
+        return h.run(max_instructions);
+
+    // A quantum or budget shorter than the period still gets sampled, the
+    // countdown carries over from one call to the next
+    uint64_t& left = sampler->until_sample(h.id());
+    for (;;)
+    {
+        uint64_t before = h.instret();
+        exit_reason reason = h.run(std::min(max_instructions, left));
+        uint64_t done = h.instret() - before;
+        max_instructions -= done;
+        left -= done;
+        if (left == 0)
+        {
+            sampler->sample(h, mem);
+            left = sampler->period();
+        }
+        if (reason != EXIT_LIMIT || max_instructions == 0)
+            return reason;
+    }
+}
+
+bool machine::read(uint32_t addr, void* out, uint64_t len) const
+{
+    if ((uint64_t)addr + len > mem.size())
+        return false;
+    std::memcpy(out, mem.data() + addr, len);
+    return true;
+}
+
+bool machine::write(uint32_t addr, const void* data, uint64_t len)
+{
+    if ((uint64_t)addr + len > mem.size())
+        return false;
+    if (len == 0)
+        return true;
+    std::memcpy(mem.data() + addr, data, len);
+    for (auto& h : harts)
+        h->invalidate(addr, len);
+    return true;
+}
@@ -0,0 +1,164 @@
+#ifndef MACHINE_HPP
+#define MACHINE_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cpu.hpp"
+#include "core.hpp"
+#include "memory.hpp"
+#include "decode_cache.hpp"
+#include "block_cache.hpp"
+#include "elf_loader.hpp"
+#include "syscall.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+
+// One hardware thread: its architectural state plus the decode and block
+// caches the cores run from. Harts are created and owned by a machine.
+class hart
+{
+public:
+    hart(guest_memory& memory, syscall_proxy& syscalls, core_kind core, uint32_t id);
+
+    hart(const hart&) = delete;
+    hart& operator=(const hart&) = delete;
+
+    // Run until EBREAK, a fault, the exit system call, max_instructions
+    // more have retired, or an interrupt. Other system calls are carried out
+    // on the way. After EXIT_LIMIT or EXIT_INTERRUPTED the hart carries on
+    // where it stopped when run again, and a run cut into several slices
+    // retires exactly the same instructions as one that isn't.
+    exit_reason run(uint64_t max_instructions = UINT64_MAX);
+    exit_reason step() { return run(1); }
+
+    // Make the hart stop with EXIT_INTERRUPTED at its next taken branch or
+    // jump. Safe to call from any thread; if the hart isn't running it stops
+    // there the next time it is.
+    void interrupt() { request_interrupt(cpu); }
+
+    // Zero the registers and instret and start over at pc, with the hart id
+    // in a0 as boot code expects
+    void reset(uint32_t pc);
+
+    uint32_t reg(uint32_t r) const { return cpu.gp_regs[r]; }
+    void set_reg(uint32_t r, uint32_t value) { if (r != 0) cpu.gp_regs[r] = value; }
+    uint32_t pc() const { return cpu.pc_reg; }
+    void set_pc(uint32_t pc) { cpu.pc_reg = pc; }
+    uint64_t instret() const { return cpu.instret; }
+    uint32_t id() const { return cpu.hart_id; }
+
+    cpu_state& state() { return cpu; }
+    const cpu_state& state() const { return cpu; }
+    block_cache& blocks() { return bcache; }
+
+    // Record every instruction retired into writer, nullptr to stop. A
+    // traced hart runs on the switch core whatever it was created with.
+    void set_trace(trace_writer* writer) { trace = writer; }
+
+    // Forget cached decodes and translations of [addr, addr + len), or of
+    // everything
+    void invalidate(uint32_t addr, uint64_t len);
+    void invalidate_all();
+
+private:
+    guest_memory& memory;
+    syscall_proxy& syscalls;
+    decode_cache icache;
+    block_cache bcache;
+    core_kind core;
+    trace_writer* trace = nullptr;
+    cpu_state cpu;
+};
+
+// A guest system: memory, the loaded program and its harts. Everything the
+// brv executable does goes through here, so it can be embedded in-process.
+//
+// Harts share guest memory but nothing else; each has its own caches, so a
+// hart only sees code another hart wrote after it executes FENCE.I.
+class machine
+{
+public:
+    explicit machine(uint64_t memory_size = 1ull << 32, core_kind core = CORE_BLOCK, uint32_t hart_count = 1);
+
+    machine(const machine&) = delete;
+    machine& operator=(const machine&) = delete;
+
+    // Load an ELF executable, or a raw image at address 0, and reset every
+    // hart to its entry point. The guest heap starts after the image. Prints
+    // the reason and returns false on failure.
+    bool load(const char* path);
+
+    // The same without printing, the reason goes to error instead
+    bool load(const char* path, std::string& error);
+
+    // Copy a raw image into memory at addr and reset every hart to addr
+    bool load(const void* image, uint64_t len, uint32_t addr = 0);
+
+    // Reset every hart to the entry point, and close the guest's files.
+    // Memory is left as it is.
+    void reset();
+
+    // Back to how the machine was created: memory zeroed, nothing loaded
+    // and every hart reset. Cheaper than a new machine, only the pages and
+    // caches the last program touched have anything to free.
+    void clear();
+
+    // Run every hart on its own host thread until it stops, hart 0 on the
+    // calling thread. Returns why each one stopped. With a timeout, harts
+    // still running once it has passed are interrupted.
+    std::vector<exit_reason> run(uint64_t max_instructions = UINT64_MAX, std::chrono::nanoseconds timeout = {});
+
+    // Run every hart on the calling thread instead, taking turns in hart
+    // order for quantum instructions each. Unless the guest reads the time
+    // CSR, how the harts interleave and so the whole run is the same every
+    // time. A host can time-slice many machines the same way, a quantum at
+    // a time through hart::run.
+    std::vector<exit_reason> run_interleaved(uint64_t quantum, uint64_t max_instructions = UINT64_MAX,
+                                             std::chrono::nanoseconds timeout = {});
+
+    // Interrupt every hart, from any thread
+    void interrupt();
+
+    // Save the registers, CSRs and heap of every hart and each page of
+    // memory that isn't all zeroes to path, to carry on from later. The
+    // guest's open files aren't part of it.
+    bool save_snapshot(const char* path) const;
+
+    // Carry on from a snapshot of a machine with as many harts and as much
+    // memory. Its pages are mapped copy on write, only the ones the guest
+    // goes on to use are read in. Prints the reason and returns false on
+    // failure, leaving memory cleared.
+    bool restore_snapshot(const char* path);
+
+    // Sample every hart with prof while running, nullptr to stop. The
+    // profiler must have a ring for each hart.
+    void set_profiler(profiler* prof) { sampler = prof; }
+
+    // Host side memory access, writes invalidate cached code on every hart
+    bool read(uint32_t addr, void* out, uint64_t len) const;
+    bool write(uint32_t addr, const void* data, uint64_t len);
+
+    hart& hart_at(uint32_t i) { return *harts[i]; }
+    uint32_t hart_count() const { return harts.size(); }
+    guest_memory& memory() { return mem; }
+    syscall_proxy& syscalls() { return sys; }
+    const elf_image& image() const { return elf; }
+    uint32_t entry() const { return entry_pc; }
+
+private:
+    exit_reason run_hart(hart& h, uint64_t max_instructions);
+
+    guest_memory mem;
+    syscall_proxy sys;
+    profiler* sampler = nullptr;
+    elf_image elf;
+    uint32_t entry_pc = 0;
+    uint32_t image_end = 0;
+    std::vector<std::unique_ptr<hart>> harts;
+};
+
+#endif
@@ -1,318 +1,263 @@
 #include <cstdint>
-#include <array>
+#include <string>
 #include <vector>
-#include <iostream>
-#include <fstream>
+#include <chrono>
 #include <memory>
+#include <cstdio>
+#include <algorithm>
+#include <thread>
 
 #include <fmt/core.h>
 
 #include "debug.hpp"
-#include "unions.hpp"
-
-inline int32_t sign_extend(uint32_t a, uint8_t shift)
-{
-    return (int32_t)(a << shift) >> shift;
-}
+#include "machine.hpp"
+#include "batch.hpp"
 
 int main(int argc, char* argv[])
 {
-    fmt::print("Got {} arguments\n", argc);
-    for (std::size_t i = 0; i < argc; i++)
-        fmt::print("Argument {}: {}\n", i, argv[i]);
+    // Options start with "--", the first other argument is the binary to run
+    std::string core_name = "block";
+    bool fusion_stats = false;
+    uint32_t hart_count = 1;
+    std::string profile_path;
+    uint64_t profile_period = 100003; // Prime, so loops don't alias with it
+    std::string stats_path;
+    std::string trace_path;
+    std::string snapshot_path;
+    std::string restore_path;
+    uint64_t snapshot_at = UINT64_MAX;
+    uint64_t budget = UINT64_MAX;
+    double timeout = 0;
+    uint64_t quantum = 0;
+    std::string batch_path;
+    uint32_t job_workers = std::max(1u, std::thread::hardware_concurrency());
+    const char* binary_path = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.rfind("--core=", 0) == 0)
+            core_name = arg.substr(7);
+        else if (arg == "--fusion-stats")
+            fusion_stats = true;
+        else if (arg.rfind("--harts=", 0) == 0)
+            hart_count = std::stoul(arg.substr(8));
+        else if (arg.rfind("--profile=", 0) == 0)
+            profile_path = arg.substr(10);
+        else if (arg.rfind("--profile-period=", 0) == 0)
+            profile_period = std::stoull(arg.substr(17));
+        else if (arg.rfind("--trace=", 0) == 0)
+            trace_path = arg.substr(8);
+        else if (arg.rfind("--stats=", 0) == 0)
+            stats_path = arg.substr(8);
+        else if (arg.rfind("--snapshot=", 0) == 0)
+            snapshot_path = arg.substr(11);
+        else if (arg.rfind("--snapshot-at=", 0) == 0)
+            snapshot_at = std::stoull(arg.substr(14));
+        else if (arg.rfind("--restore=", 0) == 0)
+            restore_path = arg.substr(10);
+        else if (arg.rfind("--budget=", 0) == 0)
+            budget = std::stoull(arg.substr(9));
+        else if (arg.rfind("--timeout=", 0) == 0)
+            timeout = std::stod(arg.substr(10));
+        else if (arg.rfind("--quantum=", 0) == 0)
+            quantum = std::stoull(arg.substr(10));
+        else if (arg.rfind("--batch=", 0) == 0)
+            batch_path = arg.substr(8);
+        else if (arg.rfind("--jobs=", 0) == 0)
+            job_workers = std::stoul(arg.substr(7));
+        else if (!binary_path)
+            binary_path = argv[i];
+    }
+
+    // In batch mode stdout is only records
+    if (batch_path.empty())
+    {
+        fmt::print("Got {} arguments\n", argc);
+        for (std::size_t i = 0; i < argc; i++)
+            fmt::print("Argument {}: {}\n", i, argv[i]);
+    }
+
+    core_kind core;
+    if (core_name == "switch")
+        core = CORE_SWITCH;
+    else if (core_name == "threaded")
+        core = CORE_THREADED;
+    else if (core_name == "block")
+        core = CORE_BLOCK;
+    else
+    {
+        fmt::print("Unknown core '{}', expected 'switch', 'threaded' or 'block'\n", core_name);
+        return 0;
+    }
 
-    const uint64_t MEM_MAX = 1 << 23;
+    // Traced harts always run on the switch core
+    if (!trace_path.empty())
+        core_name = "traced switch";
 
-    std::unique_ptr<uint8_t[]> memory = std::make_unique<uint8_t[]>(MEM_MAX);
-    std::memset(memory.get(), 0, MEM_MAX * sizeof(*memory.get()));
+    const uint64_t MEM_MAX = 1ull << 32;
 
-    component _ebreak; _ebreak.word = 0x00100073;
-    for(std::size_t m = 0; m < 4; m++) memory[m] = _ebreak.byte[m];
+    // Wall clock seconds, checked by a watchdog thread
+    auto timeout_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(std::max(timeout, 0.0)));
 
-    std::ifstream binary;
-    if (argc > 1)
+    if (hart_count < 1 || hart_count > 1024)
     {
-        binary.open(argv[1], std::ios::in | std::ios::binary | std::ios::ate);
+        fmt::print("Hart count must be between 1 and 1024\n");
+        return 0;
+    }
 
-        if (!binary.is_open())
+    // Many programs, one record each, read from a manifest or - for stdin
+    if (!batch_path.empty())
+    {
+        std::FILE* in = batch_path == "-" ? stdin : std::fopen(batch_path.c_str(), "r");
+        if (!in)
         {
-            fmt::print("File does not exist or could not be opened\n");
+            fmt::print("Could not open batch manifest {}\n", batch_path);
             return 0;
         }
+        batch_options options;
+        options.core = core;
+        options.workers = job_workers;
+        options.hart_count = hart_count;
+        options.memory_size = MEM_MAX;
+        options.timeout = timeout_ns;
+        uint64_t failed = run_batch(in, stdout, options);
+        if (in != stdin)
+            std::fclose(in);
+        return failed ? 1 : 0;
+    }
+
+    machine vm(MEM_MAX, core, hart_count);
+    if (binary_path && !vm.load(binary_path))
+        return 0;
 
-        std::streampos diff = binary.tellg();
-        binary.seekg(0);
+    // Start from a snapshot instead, a binary given too only lends its symbols
+    if (!restore_path.empty() && !vm.restore_snapshot(restore_path.c_str()))
+        return 0;
 
-        if (diff > MEM_MAX)
+    // Flat profile to stderr and folded stacks to the given file on exit
+    std::unique_ptr<profiler> prof;
+    if (!profile_path.empty())
+    {
+        prof = std::make_unique<profiler>(hart_count, profile_period);
+        vm.set_profiler(prof.get());
+    }
+
+    // A binary trace per hart, FILE.N for all but hart 0
+    std::vector<std::unique_ptr<trace_writer>> traces;
+    if (!trace_path.empty())
+    {
+        for (uint32_t i = 0; i < vm.hart_count(); i++)
         {
-            fmt::print("Input file size larger than RISCV memory\n");
-            return 0;
+            std::string path = i == 0 ? trace_path : fmt::format("{}.{}", trace_path, i);
+            traces.push_back(std::make_unique<trace_writer>());
+            if (!traces[i]->open(path.c_str(), i))
+            {
+                fmt::print("Could not open trace file {}\n", path);
+                return 0;
+            }
+            vm.hart_at(i).set_trace(traces[i].get());
         }
+    }
 
-        std::unique_ptr<char[]> filebuff = std::make_unique<char[]>(diff);;
-        std::memset(filebuff.get(), 0, diff * sizeof(*filebuff.get()));
-        binary.read(filebuff.get(), diff);
-        binary.close();
+    // BEGIN INTERPRETATION
+    auto start = std::chrono::steady_clock::now();
+    // With a quantum the harts share this thread in a fixed order instead
+    uint64_t limit = std::min(budget, snapshot_at);
+    std::vector<exit_reason> reasons = quantum ? vm.run_interleaved(quantum, limit, timeout_ns) : vm.run(limit, timeout_ns);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
 
-        for (std::size_t f = 0; f < diff; f++)
-            memory[f] = filebuff[f];
+    // Snapshot after --snapshot-at instructions, the budget or the timeout,
+    // or at EBREAK. The snapshot resumes past the EBREAK, the registers shown
+    // below don't.
+    if (!snapshot_path.empty() && (reasons[0] == EXIT_LIMIT || reasons[0] == EXIT_INTERRUPTED || reasons[0] == EXIT_EBREAK))
+    {
+        std::vector<uint32_t> stopped_at;
+        for (uint32_t i = 0; i < vm.hart_count(); i++)
+        {
+            hart& h = vm.hart_at(i);
+            stopped_at.push_back(h.pc());
+            uint16_t low = 0;
+            if (reasons[i] == EXIT_EBREAK && vm.read(h.pc(), &low, sizeof(low)))
+                h.set_pc(h.pc() + ((low & 3) == 3 ? 4 : 2));
+        }
+        if (!vm.save_snapshot(snapshot_path.c_str()))
+            fmt::print(stderr, "Could not write snapshot to {}\n", snapshot_path);
+        for (uint32_t i = 0; i < vm.hart_count(); i++)
+            vm.hart_at(i).set_pc(stopped_at[i]);
     }
 
-    // BEGIN INTERPRETATION
-    instr test;
-    uint32_t gp_regs[32] = { 0 };
-    uint32_t pc_reg = 0;
+    for (auto& trace : traces)
+    {
+        if (!trace->close())
+            fmt::print(stderr, "Could not write all of the trace\n");
+    }
 
-    for (;;)
+    uint64_t instret = 0;
+    for (uint32_t i = 0; i < vm.hart_count(); i++)
     {
-        component helper;
-        helper.byte[0] = memory[pc_reg + 0];
-        helper.byte[1] = memory[pc_reg + 1];
-        helper.byte[2] = memory[pc_reg + 2];
-        helper.byte[3] = memory[pc_reg + 3];
-        test.instruction = helper.word;
+        cpu_state& cpu = vm.hart_at(i).state();
+        instret += cpu.instret;
 
-        bool branched = false;
+        if (vm.hart_count() > 1)
+            fmt::print("Hart {}\n", i);
+        if (reasons[i] == EXIT_FAULT)
+            fmt::print("Memory access fault at pc {:08x}, address {:08x}\n", cpu.pc_reg, cpu.fault_addr);
+        if (reasons[i] == EXIT_EXITED)
+            fmt::print("Exited with status {}\n", vm.syscalls().exit_code());
+        if (reasons[i] == EXIT_LIMIT)
+            fmt::print("Stopped after {} instructions at pc {:08x}\n", cpu.instret, cpu.pc_reg);
+        if (reasons[i] == EXIT_INTERRUPTED)
+            fmt::print("Timed out after {}s at pc {:08x}\n", timeout, cpu.pc_reg);
 
-        imm_reconstruct imm; imm.word = 0;
-        component t; t.word = 0;
-        uint32_t ls_offset = 0;
+        spit_registers(cpu.gp_regs, cpu.pc_reg);
+        fmt::print("{}\n", spit_registers_json(cpu.gp_regs, cpu.pc_reg));
+    }
+    fmt::print(stderr, "{} core: {} instructions in {:.3f}s ({:.2f} MIPS)\n",
+               core_name, instret, elapsed.count(), instret / elapsed.count() / 1e6);
 
-        switch (test.op_only.opcode)
+    if (prof)
+    {
+        prof->print_flat(stderr, vm.image());
+        if (!prof->write_folded(profile_path.c_str(), vm.image()))
+            fmt::print(stderr, "Could not write profile to {}\n", profile_path);
+    }
+
+    if (fusion_stats)
+    {
+        for (uint32_t k = 0; k < FUSION_KINDS; k++)
         {
-            case 0b0110011: // Integer ALU R-Type
-                switch (test.r_type.funct3)
-                {
-                    case 0x0: // ADD / SUB
-                        switch (test.r_type.funct7)
-                        {
-                            case 0x00: gp_regs[test.r_type.rd] = gp_regs[test.r_type.rs1] + gp_regs[test.r_type.rs2]; break;
-                            case 0x20: gp_regs[test.r_type.rd] = gp_regs[test.r_type.rs1] - gp_regs[test.r_type.rs2]; break;
-                        }
-                        break;
-                    case 0x4: // XOR (RV32I only has one instruction for funct3)
-                        switch (test.r_type.funct7)
-                        {
-                            case 0x00: gp_regs[test.r_type.rd] = gp_regs[test.r_type.rs1] ^ gp_regs[test.r_type.rs2]; break;
-                        }
-                        break;
-                    case 0x6: // OR (RV32I only has one instruction for funct3)
-                        switch (test.r_type.funct7)
-                        {
-                            case 0x00: gp_regs[test.r_type.rd] = gp_regs[test.r_type.rs1] | gp_regs[test.r_type.rs2]; break;
-                        }
-                        break;
-                    case 0x7: // AND (RV32I only has one instruction for funct3)
-                        switch (test.r_type.funct7)
-                        {
-                            case 0x00: gp_regs[test.r_type.rd] = gp_regs[test.r_type.rs1] & gp_regs[test.r_type.rs2]; break;
-                        }
-                        break;
-                    case 0x1: // SLL (RV32I only has one instruction for funct3)
-                        switch (test.r_type.funct7)
-                        {
-                            case 0x00: gp_regs[test.r_type.rd] = gp_regs[test.r_type.rs1] << gp_regs[test.r_type.rs2]; break;
-                        }
-                        break;
-                    case 0x5: // SRL / SRA (Should be working fine)
-                        switch (test.r_type.funct7)
-                        {
-                            case 0x00: gp_regs[test.r_type.rd] = gp_regs[test.r_type.rs1] >> gp_regs[test.r_type.rs2]; break;
-                            case 0x20: gp_regs[test.r_type.rd] = (int32_t)gp_regs[test.r_type.rs1] >> gp_regs[test.r_type.rs2]; break;
-                        }
-                        break;
-                    case 0x2: // SLT (Set Less Than [signed?]) (RV32I only has one instruction for funct3)
-                        switch (test.r_type.funct7)
-                        {
-                            case 0x00: gp_regs[test.r_type.rd] = (int32_t)gp_regs[test.r_type.rs1] < (int32_t)gp_regs[test.r_type.rs2] ? 1 : 0; break;
-                        }
-                        break;
-                    case 0x3: // SLTU (Set Less Than Unsigned) (RV32I only has one instruction for funct3)
-                        switch (test.r_type.funct7)
-                        {
-                            case 0x00: gp_regs[test.r_type.rd] = gp_regs[test.r_type.rs1] < gp_regs[test.r_type.rs2] ? 1 : 0; break;
-                        }
-                        break;
-                }
-                break;
-            case 0b0010011: // Integer ALU I-Type NOTE: Immediates are sign-extended (they're signed by DEFAULT, their MSB gets extended to the left [all ones to the left])
-                switch (test.i_type.funct3)
-                {
-                    // ADDI -- TESTED
-                    case 0x0: gp_regs[test.i_type.rd] = gp_regs[test.i_type.rs1] + sign_extend(test.i_type.imm, 20); break;
-                    // XORI -- TESTED
-                    case 0x4: gp_regs[test.i_type.rd] = gp_regs[test.i_type.rs1] ^ sign_extend(test.i_type.imm, 20); break;
-                    // ORI
-                    case 0x6: gp_regs[test.i_type.rd] = gp_regs[test.i_type.rs1] | sign_extend(test.i_type.imm, 20); break;
-                    // ANDI
-                    case 0x7: gp_regs[test.i_type.rd] = gp_regs[test.i_type.rs1] & sign_extend(test.i_type.imm, 20); break;
-                    // SLLI / first 5 bits
-                    case 0x1: gp_regs[test.i_type.rd] = gp_regs[test.i_type.rs1] << (sign_extend(test.i_type.imm, 20) & 0x1F); break;
-                    // SRLI / SRAI
-                    case 0x5:
-                        switch ((test.i_type.imm & 0b111111100000) >> 5) // Subdivide the IMM value again with a union?
-                        {
-                            case 0x00: gp_regs[test.i_type.rd] = gp_regs[test.i_type.rs1] >> (sign_extend(test.i_type.imm, 20) & 0x1F); break;
-                            case 0x20: gp_regs[test.i_type.rd] = (int32_t)gp_regs[test.i_type.rs1] >> (sign_extend(test.i_type.imm, 20) & 0x1F); break;
-                        }
-                        break;
-                    // SLTI (Set Less Than Immediate)
-                    case 0x2: gp_regs[test.i_type.rd] = (int32_t)gp_regs[test.i_type.rs1] < (int32_t)sign_extend(test.i_type.imm, 20) ? 1 : 0; break;
-                    // SLTIU (Set Less Than Immediate Unsigned)
-                    case 0x3: gp_regs[test.i_type.rd] = gp_regs[test.i_type.rs1] < sign_extend(test.i_type.imm, 20 ? 1 : 0); break;
-                }
-                break;
-            case 0b0000011: // Integer Load I-Type -- ~~TESTED~~ / Needs retesting, switched to a UNION
-                ls_offset = gp_regs[test.i_type.rs1] + sign_extend(test.i_type.imm, 20);
-                switch (test.i_type.funct3)
-                {
-                    case 0x0: // LB (Load Byte, sign extended)
-                        // Need the lowest 8-bits, sign extended, immediate value
-                        t.byte[3] = memory[ls_offset + 0];
-                        gp_regs[test.i_type.rd] = t.word_s >> 24;
-                        break;
-                    case 0x1: // LH (Load Half, sign-extended)
-                        // Need the lowest 16-bits, sign extended, immediate value
-                        t.byte[2] = memory[ls_offset + 0];
-                        t.byte[3] = memory[ls_offset + 1];
-                        gp_regs[test.i_type.rd] = t.word_s >> 16;
-                        break;
-                    case 0x2: // LW (Load Word)
-                        t.byte[0] = memory[ls_offset + 0];
-                        t.byte[1] = memory[ls_offset + 1];
-                        t.byte[2] = memory[ls_offset + 2];
-                        t.byte[3] = memory[ls_offset + 3];
-                        gp_regs[test.i_type.rd] = t.word;
-                        break;
-                    case 0x4: // LBU (Load Byte Unsigned)
-                        t.byte[0] = memory[ls_offset + 0];
-                        gp_regs[test.i_type.rd] = t.word;
-                        break;
-                    case 0x5: // LHU (Load Half Unsigned)
-                        t.byte[0] = memory[ls_offset + 0];
-                        t.byte[1] = memory[ls_offset + 1];
-                        gp_regs[test.i_type.rd] = t.word;
-                        break;
-                }
-                break;
-            case 0b0100011: // Integer Store S-Type
-                imm.s_imm = {test.s_type.imm4_0, test.s_type.imm11_5, 0};
-                t.word = gp_regs[test.s_type.rs2];
-                ls_offset = gp_regs[test.s_type.rs1] + sign_extend(imm.word, 20);
-                switch (test.s_type.funct3)
-                {
-                    case 0x0: // SB
-                        memory[gp_regs[test.s_type.rs1] + ls_offset + 0] = t.byte[0];
-                        break;
-                    case 0x1: // SH
-                        memory[gp_regs[test.s_type.rs1] + ls_offset + 0] = t.byte[0];
-                        memory[gp_regs[test.s_type.rs1] + ls_offset + 1] = t.byte[1];
-                        break;
-                    case 0x2: //SW
-                        memory[gp_regs[test.s_type.rs1] + ls_offset + 0] = t.byte[0];
-                        memory[gp_regs[test.s_type.rs1] + ls_offset + 1] = t.byte[1];
-                        memory[gp_regs[test.s_type.rs1] + ls_offset + 2] = t.byte[2];
-                        memory[gp_regs[test.s_type.rs1] + ls_offset + 3] = t.byte[3];
-                        break;
-                }
-                break;
-            case 0b1100011: // Integer Branch B-Type
-                imm.b_imm = {0, test.b_type.imm4_1, test.b_type.imm10_5, test.b_type.imm11, test.b_type.imm12, 0};
-                switch (test.b_type.funct3)
-                {
-                    case 0x0: // BEQ -- Signed or unsigned doesn't matter, since either it's equal or not.
-                        if (gp_regs[test.b_type.rs1] == gp_regs[test.b_type.rs2])
-                        {
-                            branched = true;
-                            pc_reg += sign_extend(imm.word, 19);
-                        }
-                        break;
-                    case 0x1: // BNE -- Signed or unsigned doesn't matter, since either it's equal or not.
-                        if (gp_regs[test.b_type.rs1] != gp_regs[test.b_type.rs2])
-                        {
-                            branched = true;
-                            pc_reg += sign_extend(imm.word, 19);
-                        }
-                        break;
-                    case 0x4: // BLT
-                        if ((signed)gp_regs[test.b_type.rs1] < (signed)gp_regs[test.b_type.rs2])
-                        {
-                            branched = true;
-                            pc_reg += sign_extend(imm.word, 19);
-                        }
-                        break;
-                    case 0x5: // BGE
-                        if ((signed)gp_regs[test.b_type.rs1] >= (signed)gp_regs[test.b_type.rs2])
-                        {
-                            branched = true;
-                            pc_reg += sign_extend(imm.word, 19);
-                        }
-                        break;
-                    case 0x6: // BLTU
-                        if (gp_regs[test.b_type.rs1] < gp_regs[test.b_type.rs2])
-                        {
-                            branched = true;
-                            pc_reg += sign_extend(imm.word, 19);
-                        }
-                        break;
-                    case 0x7: // BGEU
-                        if (gp_regs[test.b_type.rs1] >= gp_regs[test.b_type.rs2])
-                        {
-                            branched = true;
-                            pc_reg += sign_extend(imm.word, 19);
-                        }
-                        break;
-                }
-                break;
-            case 0b1101111: // Integer JAL J-Type
-                {
-                    imm.j_imm = {0, test.j_type.imm10_1, test.j_type.imm11, test.j_type.imm19_12, test.j_type.imm20, 0};
-                    gp_regs[test.j_type.rd] = pc_reg + 4;
-                    branched = true;
-                    pc_reg += sign_extend(imm.word, 11);
-                }
-                break;
-            // Integer JALR I-Type
-            case 0b1100111:
-                switch (test.i_type.funct3)
-                {
-                    case 0x0:
-                        {
-                            gp_regs[test.i_type.rd] = pc_reg + 4;
-                            branched = true;
-                            pc_reg = gp_regs[test.i_type.rs1] + sign_extend(test.i_type.imm, 20);
-                        }
-                        break;
-                }
-                break;
-            // Integer LUI U-Type
-            case 0b0110111: if (test.u_type.rd != 0) gp_regs[test.u_type.rd] = (uint32_t)test.u_type.imm31_12 << 12; break;
-            // Integer AUIPC U-Type
-            case 0b0010111: if (test.u_type.rd != 0) gp_regs[test.u_type.rd] = pc_reg + ((uint32_t)test.u_type.imm31_12 << 12); break;
-            case 0b1110011: // Integer ECALL/EBREAK I-Type
-                switch (test.i_type.funct3)
-                {
-                    case 0x0: // Funct3 is always 0x0 in the base instruction set
-                        switch (test.i_type.imm)
-                        {
-                            // ECALL
-                            case 0x0: break;
-                            // EBREAK
-                            case 0x1: spit_registers(gp_regs, pc_reg); fmt::print("{}\n", spit_registers_json(gp_regs, pc_reg)); return 0; break;
-                        }
-                        break;
-                }
-                break;
+            uint64_t sites = 0, hits = 0;
+            for (uint32_t i = 0; i < vm.hart_count(); i++)
+            {
+                sites += vm.hart_at(i).blocks().fusion_sites[k];
+                hits += vm.hart_at(i).blocks().fusion_hits[k];
+            }
+            fmt::print(stderr, "{:<12} fused {:>8} interpreted {:>12}\n", fusion_names[k], sites, hits);
         }
+    }
 
-        // Reset zero/x0 register to 0. Prevent branching.
-        gp_regs[0] = 0;
-
-        // Increment PC if we haven't branched/jumped
-        if (!branched)
-            pc_reg += 4;
-
+    // Instruction mix of all harts together, as JSON
+    if (!stats_path.empty())
+    {
+#ifdef BRV_STATS
+        exec_stats total;
+        for (uint32_t i = 0; i < vm.hart_count(); i++)
+            total.merge(vm.hart_at(i).state().stats);
+        std::FILE* out = std::fopen(stats_path.c_str(), "w");
+        if (out)
+        {
+            fmt::print(out, "{}\n", stats_json(total));
+            std::fclose(out);
+        }
+        else
+            fmt::print(stderr, "Could not write statistics to {}\n", stats_path);
+#else
+        fmt::print(stderr, "--stats needs a build configured with -DBRV_STATS=ON\n");
+#endif
     }
 
+    // A guest that exits through the syscall layer hands its status to the host
+    if (reasons[0] == EXIT_EXITED)
+        return vm.syscalls().exit_code();
     return 0;
 }
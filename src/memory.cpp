@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+
+#include <fmt/core.h>
+
+#include "memory.hpp"
+
+// Pages are reserved, not committed: the kernel backs each 4 KiB page with
+// the shared zero page on first read and a private page on first write, so
+// startup costs nothing and the footprint follows the pages the guest touches
+guest_memory::guest_memory(uint64_t size)
+    : length(size), granule_versions(std::make_unique<std::atomic<uint32_t>[]>(GRANULE_SLOTS))
+{
+    void* mem = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        fmt::print("Could not map {} bytes of guest memory\n", size);
+        std::abort();
+    }
+    bytes = static_cast<uint8_t*>(mem);
+}
+
+guest_memory::~guest_memory()
+{
+    munmap(bytes, length);
+}
+
+bool guest_memory::map_file(int fd, uint64_t offset, uint32_t addr, uint64_t len)
+{
+    if ((offset | addr) & 4095 || (uint64_t)addr + len > length)
+        return false;
+    if (len == 0)
+        return true;
+    void* at = mmap(bytes + addr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset);
+    if (at == MAP_FAILED)
+        return false;
+    mapped_files.emplace_back(addr, len);
+    return true;
+}
+
+void guest_memory::clear()
+{
+    // Only resident pages can have been written, and of those only the ones
+    // that aren't zero need zeroing. Pages that were only read stay mapped
+    // to the kernel's zero page.
+    if (length <= CLEAR_IN_PLACE && mapped_files.empty())
+    {
+        uint64_t page_count = (length + 4095) / 4096;
+        std::vector<unsigned char> resident(page_count);
+        if (mincore(bytes, length, resident.data()) == 0)
+        {
+            static const uint8_t zeroes[4096] = { 0 };
+            for (uint64_t page = 0; page < page_count; page++)
+            {
+                if (!(resident[page] & 1))
+                    continue;
+                uint8_t* at = bytes + page * 4096;
+                uint64_t len = std::min<uint64_t>(4096, length - page * 4096);
+                if (std::memcmp(at, zeroes, len) != 0)
+                    std::memset(at, 0, len);
+            }
+            return;
+        }
+    }
+
+    // Mapping fresh anonymous memory over the old drops file pages too, which
+    // MADV_DONTNEED would only take back to the file's contents
+    void* mem = mmap(bytes, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        fmt::print("Could not map {} bytes of guest memory\n", length);
+        std::abort();
+    }
+    mapped_files.clear();
+}
+
+// Anonymous pages nothing has touched aren't resident, so only the resident
+// ones and those mapped from files need looking at
+std::vector<uint32_t> guest_memory::touched_pages() const
+{
+    uint64_t page_count = (length + 4095) / 4096;
+    std::vector<unsigned char> candidate(page_count);
+    if (mincore(bytes, length, candidate.data()) != 0)
+        std::fill(candidate.begin(), candidate.end(), 1);
+    for (auto [addr, len] : mapped_files)
+        std::fill_n(candidate.begin() + addr / 4096, (len + 4095) / 4096, 1);
+
+    static const uint8_t zeroes[4096] = { 0 };
+    std::vector<uint32_t> pages;
+    for (uint64_t page = 0; page < page_count; page++)
+    {
+        uint64_t len = std::min<uint64_t>(4096, length - page * 4096);
+        if ((candidate[page] & 1) && std::memcmp(bytes + page * 4096, zeroes, len) != 0)
+            pages.push_back(page);
+    }
+    return pages;
+}
+
+// Misaligned or out of range accesses
+bool guest_memory::read_slow(uint32_t addr, void* out, uint32_t len) const
+{
+    if ((uint64_t)addr + len > length)
+        return false;
+    std::memcpy(out, &bytes[addr], len);
+    return true;
+}
+
+bool guest_memory::write_slow(uint32_t addr, const void* value, uint32_t len)
+{
+    if ((uint64_t)addr + len > length)
+        return false;
+    std::memcpy(&bytes[addr], value, len);
+    return true;
+}
@@ -0,0 +1,144 @@
+#ifndef MEMORY_HPP
+#define MEMORY_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Guest physical memory, up to the full 4 GiB RV32 address space, reserved
+// up front and populated page by page as the guest touches it, and shared by
+// every hart. Accessors return false when any byte of the access falls
+// outside guest memory. Aligned accesses are a single bounds compare
+// against their last byte, which the size need not be a multiple of, and a
+// single host load/store; misaligned ones go through the byte-wise slow path.
+class guest_memory
+{
+public:
+    explicit guest_memory(uint64_t size);
+    ~guest_memory();
+
+    guest_memory(const guest_memory&) = delete;
+    guest_memory& operator=(const guest_memory&) = delete;
+
+    uint8_t* data() { return bytes; }
+    const uint8_t* data() const { return bytes; }
+    uint64_t size() const { return length; }
+
+    // Map len bytes of fd starting at offset over guest memory at addr, copy
+    // on write. offset and addr must be page aligned; the rest of the last
+    // page reads as zero.
+    bool map_file(int fd, uint64_t offset, uint32_t addr, uint64_t len);
+
+    // Back to all zeroes, dropping file mappings along with everything else.
+    // Memories up to CLEAR_IN_PLACE bytes keep the pages that were written,
+    // zeroed, so a program run over and over doesn't fault them in again.
+    void clear();
+    static constexpr uint64_t CLEAR_IN_PLACE = 64ull << 20;
+
+    // Numbers of the 4 KiB pages that aren't all zeroes, in order
+    std::vector<uint32_t> touched_pages() const;
+
+    // Host atomic view of the aligned word at addr, which must be in range
+    std::atomic_ref<uint32_t> word(uint32_t addr)
+    {
+        return std::atomic_ref<uint32_t>(*reinterpret_cast<uint32_t*>(&bytes[addr]));
+    }
+
+    // Version counter of the LR/SC reservation granule holding addr, bumped
+    // by every successful SC.W and every AMO into it. Granules hash onto a
+    // fixed table, so unrelated ones may share a counter, which only costs a
+    // spurious failure.
+    std::atomic<uint32_t>& granule_version(uint32_t addr)
+    {
+        return granule_versions[(addr / RESERVATION_GRANULE) % GRANULE_SLOTS];
+    }
+
+    bool read8(uint32_t addr, uint8_t& out) const
+    {
+        if (addr < length) [[likely]]
+        {
+            out = load<uint8_t>(addr);
+            return true;
+        }
+        return false;
+    }
+
+    bool read16(uint32_t addr, uint16_t& out) const
+    {
+        if ((addr & 1) == 0 && (uint64_t)addr + sizeof(out) <= length) [[likely]]
+        {
+            out = load<uint16_t>(addr);
+            return true;
+        }
+        return read_slow(addr, &out, sizeof(out));
+    }
+
+    bool read32(uint32_t addr, uint32_t& out) const
+    {
+        if ((addr & 3) == 0 && (uint64_t)addr + sizeof(out) <= length) [[likely]]
+        {
+            out = load<uint32_t>(addr);
+            return true;
+        }
+        return read_slow(addr, &out, sizeof(out));
+    }
+
+    bool write8(uint32_t addr, uint8_t value)
+    {
+        if (addr < length) [[likely]]
+        {
+            store<uint8_t>(addr, value);
+            return true;
+        }
+        return false;
+    }
+
+    bool write16(uint32_t addr, uint16_t value)
+    {
+        if ((addr & 1) == 0 && (uint64_t)addr + sizeof(value) <= length) [[likely]]
+        {
+            store(addr, value);
+            return true;
+        }
+        return write_slow(addr, &value, sizeof(value));
+    }
+
+    bool write32(uint32_t addr, uint32_t value)
+    {
+        if ((addr & 3) == 0 && (uint64_t)addr + sizeof(value) <= length) [[likely]]
+        {
+            store(addr, value);
+            return true;
+        }
+        return write_slow(addr, &value, sizeof(value));
+    }
+
+private:
+    template <typename T>
+    T load(uint32_t addr) const
+    {
+        return std::atomic_ref<T>(*reinterpret_cast<T*>(&bytes[addr])).load(std::memory_order_relaxed);
+    }
+
+    template <typename T>
+    void store(uint32_t addr, T value)
+    {
+        std::atomic_ref<T>(*reinterpret_cast<T*>(&bytes[addr])).store(value, std::memory_order_relaxed);
+    }
+
+    bool read_slow(uint32_t addr, void* out, uint32_t len) const;
+    bool write_slow(uint32_t addr, const void* value, uint32_t len);
+
+    static constexpr uint32_t RESERVATION_GRANULE = 64;
+    static constexpr uint32_t GRANULE_SLOTS = 4096;
+
+    uint8_t* bytes;
+    uint64_t length;
+    std::unique_ptr<std::atomic<uint32_t>[]> granule_versions;
+    std::vector<std::pair<uint32_t, uint64_t>> mapped_files; // addr and len of each map_file
+};
+
+#endif
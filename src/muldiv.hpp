@@ -0,0 +1,53 @@
+#ifndef MULDIV_HPP
+#define MULDIV_HPP
+
+#include <cstdint>
+
+// RV32M arithmetic. The upper halves come from one 64-bit host multiply;
+// division by zero and INT32_MIN / -1 give the results the spec defines
+// instead of trapping.
+
+inline uint32_t mulh(uint32_t a, uint32_t b)
+{
+    return (uint64_t)((int64_t)(int32_t)a * (int64_t)(int32_t)b) >> 32;
+}
+
+inline uint32_t mulhsu(uint32_t a, uint32_t b)
+{
+    return (uint64_t)((int64_t)(int32_t)a * (int64_t)b) >> 32;
+}
+
+inline uint32_t mulhu(uint32_t a, uint32_t b)
+{
+    return ((uint64_t)a * b) >> 32;
+}
+
+inline uint32_t div32(uint32_t a, uint32_t b)
+{
+    if (b == 0)
+        return UINT32_MAX;
+    if (a == 0x80000000u && b == UINT32_MAX)
+        return a;
+    return (int32_t)a / (int32_t)b;
+}
+
+inline uint32_t divu32(uint32_t a, uint32_t b)
+{
+    return b == 0 ? UINT32_MAX : a / b;
+}
+
+inline uint32_t rem32(uint32_t a, uint32_t b)
+{
+    if (b == 0)
+        return a;
+    if (a == 0x80000000u && b == UINT32_MAX)
+        return 0;
+    return (int32_t)a % (int32_t)b;
+}
+
+inline uint32_t remu32(uint32_t a, uint32_t b)
+{
+    return b == 0 ? a : a % b;
+}
+
+#endif
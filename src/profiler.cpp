@@ -0,0 +1,177 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <fmt/core.h>
+
+#include "profiler.hpp"
+#include "machine.hpp"
+
+bool sample_ring::push(const profile_sample& s)
+{
+    uint32_t at = head.load(std::memory_order_relaxed);
+    if (at - tail.load(std::memory_order_acquire) == SIZE)
+    {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    slots[at % SIZE] = s;
+    head.store(at + 1, std::memory_order_release);
+    return true;
+}
+
+bool sample_ring::pop(profile_sample& s)
+{
+    uint32_t at = tail.load(std::memory_order_relaxed);
+    if (at == head.load(std::memory_order_acquire))
+        return false;
+    s = slots[at % SIZE];
+    tail.store(at + 1, std::memory_order_release);
+    return true;
+}
+
+profiler::profiler(uint32_t hart_count, uint64_t period)
+    : every(std::max<uint64_t>(period, 1)), left(hart_count, every)
+{
+    for (uint32_t i = 0; i < hart_count; i++)
+        rings.push_back(std::make_unique<sample_ring>());
+
+    collector = std::thread([this]()
+    {
+        while (running.load(std::memory_order_relaxed))
+        {
+            drain();
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    });
+}
+
+profiler::~profiler()
+{
+    finish();
+}
+
+void profiler::sample(const hart& h, const guest_memory& memory)
+{
+    profile_sample s;
+    s.frames[0] = h.pc();
+    s.depth = 1;
+
+    // Each frame keeps ra at fp - 4 and the caller's fp at fp - 8, and the
+    // stack grows down, so a caller's frame is always above its callee's
+    uint32_t fp = h.reg(8);
+    while (s.depth < PROFILE_MAX_DEPTH && fp >= 8 && (fp & 3) == 0)
+    {
+        uint32_t ra, caller_fp;
+        if (!memory.read32(fp - 4, ra) || !memory.read32(fp - 8, caller_fp) || ra == 0)
+            break;
+        s.frames[s.depth++] = ra;
+        if (caller_fp <= fp)
+            break;
+        fp = caller_fp;
+    }
+
+    rings[h.id()]->push(s);
+}
+
+void profiler::finish()
+{
+    if (!collector.joinable())
+        return;
+    running.store(false, std::memory_order_relaxed);
+    collector.join();
+    drain();
+}
+
+void profiler::drain()
+{
+    profile_sample s;
+    for (std::size_t i = 0; i < rings.size(); i++)
+    {
+        while (rings[i]->pop(s))
+        {
+            std::vector<uint32_t> key;
+            key.reserve(s.depth + 1);
+            key.push_back(i);
+            key.insert(key.end(), s.frames, s.frames + s.depth);
+            stacks[key]++;
+            samples++;
+        }
+    }
+}
+
+// Function name for a frame. Return addresses point past the call, so the
+// caller frames are looked up one byte back.
+static std::string frame_name(const elf_image& image, uint32_t addr, bool leaf)
+{
+    const elf_symbol* sym = image.symbol_at(leaf ? addr : addr - 1);
+    if (sym)
+        return sym->name;
+    return fmt::format("0x{:08x}", addr);
+}
+
+void profiler::print_flat(std::FILE* out, const elf_image& image, uint32_t top)
+{
+    finish();
+
+    std::unordered_map<std::string, uint64_t> self, total;
+    for (const auto& [key, count] : stacks)
+    {
+        // A recursive function is only counted once per sample in total
+        std::unordered_set<std::string> seen;
+        for (std::size_t f = 1; f < key.size(); f++)
+        {
+            std::string name = frame_name(image, key[f], f == 1);
+            if (f == 1)
+                self[name] += count;
+            if (seen.insert(name).second)
+                total[name] += count;
+        }
+    }
+
+    std::vector<std::pair<std::string, uint64_t>> order(self.begin(), self.end());
+    std::sort(order.begin(), order.end(),
+              [](const auto& a, const auto& b) { return a.second > b.second || (a.second == b.second && a.first < b.first); });
+
+    uint64_t dropped = 0;
+    for (const auto& ring : rings)
+        dropped += ring->dropped.load();
+
+    fmt::print(out, "Profile: {} samples, one per {} instructions, {} dropped\n", samples, every, dropped);
+    fmt::print(out, "{:>7} {:>7}  {}\n", "self%", "total%", "function");
+    for (std::size_t i = 0; i < order.size() && i < top; i++)
+    {
+        const auto& [name, count] = order[i];
+        fmt::print(out, "{:>6.2f}% {:>6.2f}%  {}\n", 100.0 * count / samples, 100.0 * total[name] / samples, name);
+    }
+}
+
+bool profiler::write_folded(const char* path, const elf_image& image)
+{
+    finish();
+
+    std::FILE* out = std::fopen(path, "w");
+    if (!out)
+        return false;
+
+    // Stacks that only differ in return addresses within the same functions merge
+    std::map<std::string, uint64_t> folded;
+    for (const auto& [key, count] : stacks)
+    {
+        std::string line = rings.size() > 1 ? fmt::format("hart{}", key[0]) : "";
+        for (std::size_t f = key.size() - 1; f >= 1; f--)
+        {
+            if (!line.empty())
+                line += ';';
+            line += frame_name(image, key[f], f == 1);
+        }
+        folded[line] += count;
+    }
+
+    for (const auto& [line, count] : folded)
+        fmt::print(out, "{} {}\n", line, count);
+    return std::fclose(out) == 0;
+}
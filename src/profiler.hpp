@@ -0,0 +1,90 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "memory.hpp"
+#include "elf_loader.hpp"
+
+class hart;
+
+const uint32_t PROFILE_MAX_DEPTH = 32;
+
+// A guest pc, and the return addresses found by walking the frame pointer
+// chain above it (s0 points just past the saved ra and s0 of each frame,
+// as GCC and Clang lay them out with -fno-omit-frame-pointer)
+struct profile_sample
+{
+    uint32_t depth;
+    uint32_t frames[PROFILE_MAX_DEPTH]; // frames[0] is the pc
+};
+
+// Single producer, single consumer ring of samples. The hart pushes and
+// never waits: when the collector falls behind, samples are dropped and
+// counted instead.
+class sample_ring
+{
+public:
+    bool push(const profile_sample& s);
+    bool pop(profile_sample& s);
+
+    std::atomic<uint64_t> dropped = 0;
+
+private:
+    static const uint32_t SIZE = 256;
+    profile_sample slots[SIZE];
+    std::atomic<uint32_t> head = 0; // Next slot to write, only the producer stores it
+    std::atomic<uint32_t> tail = 0; // Next slot to read, only the consumer stores it
+};
+
+// Samples every hart's guest call stack once per period retired
+// instructions. Harts take their own samples between run slices, a
+// collector thread drains the rings into per-stack counts.
+class profiler
+{
+public:
+    profiler(uint32_t hart_count, uint64_t period);
+    ~profiler();
+
+    profiler(const profiler&) = delete;
+    profiler& operator=(const profiler&) = delete;
+
+    uint64_t period() const { return every; }
+
+    // Instructions a hart has left to retire before its next sample. Counts
+    // down across however many run slices that takes, only touched from
+    // the hart's own thread.
+    uint64_t& until_sample(uint32_t hart_id) { return left[hart_id]; }
+
+    // Record where h is now, on h's own thread
+    void sample(const hart& h, const guest_memory& memory);
+
+    // Stop the collector and take in everything still queued
+    void finish();
+
+    // Functions by samples spent in them (self) and under them (total)
+    void print_flat(std::FILE* out, const elf_image& image, uint32_t top = 25);
+
+    // One line per distinct stack, root first, in the folded format
+    // flamegraph.pl and speedscope read. Returns false if path can't be written.
+    bool write_folded(const char* path, const elf_image& image);
+
+private:
+    void drain();
+
+    uint64_t every;
+    std::vector<uint64_t> left;
+    std::vector<std::unique_ptr<sample_ring>> rings;
+    std::map<std::vector<uint32_t>, uint64_t> stacks; // hart id, then frames leaf first
+    uint64_t samples = 0;
+    std::atomic<bool> running = true;
+    std::thread collector;
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include <fmt/core.h>
 
 #include "unions.hpp"
+#include "decode.hpp"
 
 #include "rv32_instr_pp_decode.hpp"
 
@@ -35,7 +36,7 @@ void print_pretty_instr(INSTR_TYPE type, instr i)
 }
 
 // TODO: Finished implementation of decoding. Only ALU R and I type instructions from RV32I are handled atm
-void rv_pp_decode(const uint32_t& word, REG_TYPE reg_type = X_TYPE)
+void rv_pp_decode(const uint32_t& word, REG_TYPE reg_type)
 {
     instr i; i.instruction = word;
     switch (i.op_only.opcode)
@@ -50,7 +51,6 @@ void rv_pp_decode(const uint32_t& word, REG_TYPE reg_type = X_TYPE)
             uint8_t rs2 = i.r_type.rs2;
             int32_t imm = (signed)word >> 20;
 
-            std::string repl_text = "{} {}{}, {}{}, {}{}\n";
             std::string mnemonic;
 
             // r_type is used since it provides easy access to funct7, even if this is the ALU I-Type case
@@ -69,7 +69,7 @@ void rv_pp_decode(const uint32_t& word, REG_TYPE reg_type = X_TYPE)
             }
 
             // FIXME: There has to be a better way to do this...
-            fmt::print(repl_text,
+            fmt::print("{} {}{}, {}{}, {}{}\n",
                        mnemonic,
                        reg_type ? "" : "x",
                        reg_type ? abi_names[rd] : std::to_string(rd),
@@ -207,3 +207,57 @@ void rv_pp_decode(const uint32_t& word, REG_TYPE reg_type = X_TYPE)
             break;
     }
 }
+
+// RV32I instructions rv_pp_decode knows. Everything else, compressed ones
+// included, is named from the decoder's op table.
+static bool pp_decodes(uint8_t op)
+{
+    return (op >= OP_ADD && op <= OP_SLTU) || (op >= OP_ADDI && op <= OP_ECALL) || op == OP_EBREAK;
+}
+
+std::string reg_name(uint32_t r, REG_TYPE reg_type)
+{
+    return reg_type == ABI_TYPE ? abi_names[r] : "x" + std::to_string(r);
+}
+
+// Operands of what rv_pp_decode doesn't print, laid out the same way
+static std::string operands(const decoded_instr& d, REG_TYPE reg_type)
+{
+    std::string rd = reg_name(d.rd, reg_type), rs1 = reg_name(d.rs1, reg_type), rs2 = reg_name(d.rs2, reg_type);
+    if (d.op >= OP_ADD && d.op <= OP_REMU)
+        return fmt::format(" {}, {}, {}", rd, rs1, rs2);
+    if (d.op >= OP_ADDI && d.op <= OP_SLTIU)
+        return fmt::format(" {}, {}, {}", rd, rs1, d.imm);
+    if (d.op >= OP_LB && d.op <= OP_LHU)
+        return fmt::format(" {}, {}({})", rd, d.imm, rs1);
+    if (d.op >= OP_SB && d.op <= OP_SW)
+        return fmt::format(" {}, {}({})", rs2, d.imm, rs1);
+    if (d.op >= OP_BEQ && d.op <= OP_BGEU)
+        return fmt::format(" {}, {}, {}", rs1, rs2, d.imm);
+    if (d.op >= OP_CSRRW && d.op <= OP_CSRRC)
+        return fmt::format(" {}, {:#x}, {}", rd, d.imm, rs1);
+    if (d.op >= OP_CSRRWI && d.op <= OP_CSRRCI)
+        return fmt::format(" {}, {:#x}, {}", rd, d.imm, d.rs1);
+    switch (d.op)
+    {
+        case OP_JAL:   return fmt::format(" {}, {}", rd, d.imm);
+        case OP_JALR:  return fmt::format(" {}, {}({})", rd, d.imm, rs1);
+        case OP_LUI:
+        case OP_AUIPC: return fmt::format(" {}, {}", rd, (uint32_t)d.imm >> 12);
+        case OP_LR_W:  return fmt::format(" {}, ({})", rd, rs1);
+        case OP_ECALL: case OP_EBREAK: case OP_FENCE: case OP_FENCE_I:
+        case OP_ILLEGAL:
+            return "";
+        default:       return fmt::format(" {}, {}, ({})", rd, rs2, rs1); // SC.W and AMOs
+    }
+}
+
+void rv_disassemble(uint32_t raw, REG_TYPE reg_type)
+{
+    bool compressed = (raw & 3) != 3;
+    decoded_instr d = compressed ? decode_compressed(raw) : decode_instr(raw);
+    if (!compressed && pp_decodes(d.op))
+        rv_pp_decode(raw, reg_type);
+    else
+        fmt::print("{}{}\n", op_names[d.op], operands(d, reg_type));
+}
@@ -1,5 +1,11 @@
+#ifndef RV32_INSTR_PP_DECODE_HPP
+#define RV32_INSTR_PP_DECODE_HPP
+
+#include <cstdint>
 #include <string>
 
+#include "unions.hpp"
+
 enum INSTR_TYPE {
     R_TYPE,
     I_TYPE,
@@ -15,7 +21,7 @@ enum REG_TYPE {
     ABI_TYPE
 };
 
-std::string abi_names[32] = {
+inline const std::string abi_names[32] = {
     "zero",
     "ra",
     "sp",
@@ -48,4 +54,16 @@ std::string abi_names[32] = {
     "t4",
     "t5",
     "t6"
-};
\ No newline at end of file
+};
+
+void print_pretty_instr(INSTR_TYPE type, instr i);
+// Prints the disassembly of an RV32I word and a newline, nothing for other extensions
+void rv_pp_decode(const uint32_t& word, REG_TYPE reg_type = X_TYPE);
+
+std::string reg_name(uint32_t r, REG_TYPE reg_type);
+
+// Prints the disassembly of any instruction brv runs, 2 or 4 bytes as the
+// low bits of raw say, through rv_pp_decode where it knows it
+void rv_disassemble(uint32_t raw, REG_TYPE reg_type = X_TYPE);
+
+#endif
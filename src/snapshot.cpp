@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#include "machine.hpp"
+
+// A snapshot is a header, the state of each hart and the numbers of the
+// pages saved, padded out to a page boundary, then the pages themselves so
+// they can be mapped straight from the file.
+const char SNAPSHOT_MAGIC[8] = { 'B', 'R', 'V', 'S', 'N', 'A', 'P', 0 };
+const uint32_t SNAPSHOT_VERSION = 1;
+const uint32_t SNAPSHOT_PAGE = 4096;
+
+struct snapshot_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t hart_count;
+    uint64_t memory_size;
+    uint32_t page_count;
+    uint32_t entry_pc;
+    uint32_t image_end;
+    uint32_t heap_start;
+    uint32_t heap_break;
+    uint32_t pad;
+};
+
+// LR.W reservations aren't kept, losing one only makes SC.W fail
+struct snapshot_hart
+{
+    uint32_t gp_regs[32];
+    uint32_t pc;
+    uint32_t pad;
+    uint64_t instret;
+    int64_t time;   // Nanoseconds since the time CSR read 0
+};
+
+static int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t data_offset(uint32_t hart_count, uint32_t page_count)
+{
+    uint64_t index_end = sizeof(snapshot_header) + hart_count * sizeof(snapshot_hart) + page_count * sizeof(uint32_t);
+    return (index_end + SNAPSHOT_PAGE - 1) / SNAPSHOT_PAGE * SNAPSHOT_PAGE;
+}
+
+bool machine::save_snapshot(const char* path) const
+{
+    std::vector<uint32_t> pages = mem.touched_pages();
+
+    snapshot_header header = {};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.hart_count = harts.size();
+    header.memory_size = mem.size();
+    header.page_count = pages.size();
+    header.entry_pc = entry_pc;
+    header.image_end = image_end;
+    header.heap_start = sys.heap_base();
+    header.heap_break = sys.heap_break();
+
+    std::vector<snapshot_hart> states(harts.size());
+    int64_t now = now_ns();
+    for (std::size_t i = 0; i < harts.size(); i++)
+    {
+        const cpu_state& cpu = harts[i]->state();
+        std::copy(std::begin(cpu.gp_regs), std::end(cpu.gp_regs), states[i].gp_regs);
+        states[i].pc = cpu.pc_reg;
+        states[i].instret = cpu.instret;
+        states[i].time = now - cpu.time_origin;
+    }
+
+    // Memory may still be mapped from the snapshot being replaced, truncating
+    // that file would pull its pages out from under the writes below. The
+    // new one takes its place only once it's complete.
+    std::string temp = std::string(path) + ".tmp";
+    std::FILE* out = std::fopen(temp.c_str(), "wb");
+    if (!out)
+        return false;
+    uint64_t offset = data_offset(harts.size(), pages.size());
+    std::vector<uint8_t> padding(offset - sizeof(header) - states.size() * sizeof(snapshot_hart) - pages.size() * sizeof(uint32_t));
+    bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1 &&
+              std::fwrite(states.data(), sizeof(snapshot_hart), states.size(), out) == states.size() &&
+              std::fwrite(pages.data(), sizeof(uint32_t), pages.size(), out) == pages.size() &&
+              std::fwrite(padding.data(), 1, padding.size(), out) == padding.size();
+
+    // The last page may be cut short by the end of memory, the file's isn't
+    static const uint8_t zeroes[SNAPSHOT_PAGE] = { 0 };
+    for (std::size_t i = 0; ok && i < pages.size(); i++)
+    {
+        uint64_t at = (uint64_t)pages[i] * SNAPSHOT_PAGE;
+        uint64_t len = std::min<uint64_t>(SNAPSHOT_PAGE, mem.size() - at);
+        ok = std::fwrite(mem.data() + at, 1, len, out) == len &&
+             std::fwrite(zeroes, 1, SNAPSHOT_PAGE - len, out) == SNAPSHOT_PAGE - len;
+    }
+    ok = std::fclose(out) == 0 && ok && std::rename(temp.c_str(), path) == 0;
+    if (!ok)
+        std::remove(temp.c_str());
+    return ok;
+}
+
+bool machine::restore_snapshot(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fmt::print("File does not exist or could not be opened\n");
+        return false;
+    }
+
+    snapshot_header header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0)
+    {
+        close(fd);
+        fmt::print("Not a brv snapshot\n");
+        return false;
+    }
+    if (header.version != SNAPSHOT_VERSION || header.hart_count != harts.size() || header.memory_size != mem.size())
+    {
+        close(fd);
+        fmt::print("Snapshot is version {} of a machine with {} harts and {} bytes of memory, expected version {}, {} harts and {} bytes\n",
+                   header.version, header.hart_count, header.memory_size, SNAPSHOT_VERSION, harts.size(), mem.size());
+        return false;
+    }
+
+    std::vector<snapshot_hart> states(header.hart_count);
+    std::vector<uint32_t> pages(header.page_count);
+    uint64_t states_len = states.size() * sizeof(snapshot_hart);
+    uint64_t pages_len = pages.size() * sizeof(uint32_t);
+    bool ok = pread(fd, states.data(), states_len, sizeof(header)) == (ssize_t)states_len &&
+              pread(fd, pages.data(), pages_len, sizeof(header) + states_len) == (ssize_t)pages_len;
+
+    // A run of consecutive pages is one mapping. A very fragmented snapshot
+    // could run out of the kernel's mappings, those runs are read in instead.
+    mem.clear();
+    uint64_t offset = data_offset(header.hart_count, header.page_count);
+    for (uint32_t i = 0; ok && i < pages.size();)
+    {
+        uint32_t n = 1;
+        while (i + n < pages.size() && pages[i + n] == pages[i] + n)
+            n++;
+        uint64_t addr = (uint64_t)pages[i] * SNAPSHOT_PAGE;
+        uint64_t len = std::min<uint64_t>((uint64_t)n * SNAPSHOT_PAGE, mem.size() - std::min<uint64_t>(addr, mem.size()));
+        uint64_t at = offset + (uint64_t)i * SNAPSHOT_PAGE;
+        ok = addr < mem.size() &&
+             (mem.map_file(fd, at, addr, len) || pread(fd, mem.data() + addr, len, at) == (ssize_t)len);
+        i += n;
+    }
+    close(fd);
+    if (!ok)
+    {
+        mem.clear();
+        fmt::print("Snapshot is cut short or damaged\n");
+        return false;
+    }
+
+    // Symbols of whatever was loaded before are kept for the profiler
+    entry_pc = header.entry_pc;
+    image_end = header.image_end;
+    sys.reset(header.heap_start, header.heap_break);
+
+    int64_t now = now_ns();
+    for (std::size_t i = 0; i < harts.size(); i++)
+    {
+        hart& h = *harts[i];
+        h.invalidate_all();
+        cpu_state& cpu = h.state();
+        uint32_t id = cpu.hart_id;
+        cpu = cpu_state();
+        cpu.hart_id = id;
+        std::copy(std::begin(states[i].gp_regs), std::end(states[i].gp_regs), cpu.gp_regs);
+        cpu.gp_regs[0] = 0;
+        cpu.pc_reg = states[i].pc;
+        cpu.instret = states[i].instret;
+        cpu.time_origin = now - states[i].time;
+    }
+    return true;
+}
@@ -0,0 +1,60 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <cstdint>
+#include <unordered_map>
+
+#include "decode.hpp"
+
+// Dynamic instruction mix of one hart, only collected in BRV_STATS builds.
+// Without it the STATS_* hooks the cores call expand to nothing.
+struct branch_counts
+{
+    uint64_t taken = 0;
+    uint64_t not_taken = 0;
+};
+
+struct exec_stats
+{
+    uint64_t ops[OP_COUNT] = { 0 }; // Retired instructions by op, as decoded
+    uint64_t loads[3] = { 0 };      // By access width: byte, half, word
+    uint64_t stores[3] = { 0 };
+    std::unordered_map<uint32_t, branch_counts> branches; // By branch pc
+
+    void branch(uint32_t pc, bool taken)
+    {
+        branch_counts& b = branches[pc];
+        (taken ? b.taken : b.not_taken)++;
+    }
+
+    // Add in another hart's counts
+    void merge(const exec_stats& other)
+    {
+        for (uint32_t i = 0; i < OP_COUNT; i++)
+            ops[i] += other.ops[i];
+        for (uint32_t i = 0; i < 3; i++)
+        {
+            loads[i] += other.loads[i];
+            stores[i] += other.stores[i];
+        }
+        for (const auto& [pc, counts] : other.branches)
+        {
+            branches[pc].taken += counts.taken;
+            branches[pc].not_taken += counts.not_taken;
+        }
+    }
+};
+
+#ifdef BRV_STATS
+#define STATS_OP(cpu, op) ((cpu).stats.ops[op]++)
+#define STATS_BRANCH(cpu, pc, taken) ((cpu).stats.branch(pc, taken))
+#define STATS_LOAD(cpu, bytes) ((cpu).stats.loads[(bytes) >> 1]++)
+#define STATS_STORE(cpu, bytes) ((cpu).stats.stores[(bytes) >> 1]++)
+#else
+#define STATS_OP(cpu, op) ((void)0)
+#define STATS_BRANCH(cpu, pc, taken) ((void)0)
+#define STATS_LOAD(cpu, bytes) ((void)0)
+#define STATS_STORE(cpu, bytes) ((void)0)
+#endif
+
+#endif
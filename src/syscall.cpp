@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "syscall.hpp"
+#include "machine.hpp"
+
+// asm-generic call numbers, which RISC-V Linux and libgloss share
+enum syscall_number : uint32_t
+{
+    NR_OPENAT = 56,
+    NR_CLOSE = 57,
+    NR_LSEEK = 62,
+    NR_READ = 63,
+    NR_WRITE = 64,
+    NR_FSTAT = 80,
+    NR_EXIT = 93,
+    NR_EXIT_GROUP = 94,
+    NR_CLOCK_GETTIME = 113,
+    NR_BRK = 214,
+    NR_CLOCK_GETTIME64 = 403
+};
+
+// Console writes this big skip the buffer
+const uint32_t DIRECT_WRITE = 4096;
+const std::size_t CONSOLE_BUFFER = 64 * 1024;
+
+const int32_t GUEST_AT_FDCWD = -100;
+
+// Write all of data, retrying short writes
+static bool write_all(int fd, const char* data, std::size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t done = ::write(fd, data, len);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return false;
+        data += done;
+        len -= done;
+    }
+    return true;
+}
+
+// Guest open flags use the asm-generic values
+static int host_open_flags(uint32_t flags)
+{
+    int host = 0;
+    switch (flags & 3)
+    {
+        case 0: host = O_RDONLY; break;
+        case 1: host = O_WRONLY; break;
+        default: host = O_RDWR; break;
+    }
+    if (flags & 0100)     host |= O_CREAT;
+    if (flags & 0200)     host |= O_EXCL;
+    if (flags & 0400)     host |= O_NOCTTY;
+    if (flags & 01000)    host |= O_TRUNC;
+    if (flags & 02000)    host |= O_APPEND;
+    if (flags & 04000)    host |= O_NONBLOCK;
+    if (flags & 0200000)  host |= O_DIRECTORY;
+    return host | O_CLOEXEC;
+}
+
+syscall_proxy::syscall_proxy(guest_memory& memory)
+    : memory(memory), files{ 0, 1, 2 }
+{
+}
+
+syscall_proxy::~syscall_proxy()
+{
+    reset(0);
+}
+
+bool syscall_proxy::handle(hart& h)
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    uint32_t a0 = h.reg(10), a1 = h.reg(11), a2 = h.reg(12), a3 = h.reg(13);
+    int32_t result;
+    last_addr = last_len = 0;
+    uint32_t nr = h.reg(17);
+    if (!host_access && nr != NR_WRITE && nr != NR_BRK && nr != NR_EXIT && nr != NR_EXIT_GROUP)
+        nr = UINT32_MAX;
+    switch (nr)
+    {
+        case NR_OPENAT: result = open_file(a0, a1, a2, a3); break;
+        case NR_CLOSE:  result = close_file(a0); break;
+        case NR_LSEEK:  result = seek_file(a0, a1, a2); break;
+        case NR_READ:   result = read_file(h, guard, a0, a1, a2); break;
+        case NR_WRITE:  result = write_file(guard, a0, a1, a2); break;
+        case NR_FSTAT:  result = stat_file(h, a0, a1); break;
+        case NR_BRK:    result = set_break(a0); break;
+        case NR_CLOCK_GETTIME:
+        case NR_CLOCK_GETTIME64:
+            result = clock_time(h, a0, a1);
+            break;
+        // exit_group only ends the calling hart, others run until they stop
+        case NR_EXIT:
+        case NR_EXIT_GROUP:
+            status = (int32_t)a0;
+            flush_console();
+            return false;
+        default:
+            result = -ENOSYS;
+            break;
+    }
+    h.set_reg(10, result);
+    return true;
+}
+
+void syscall_proxy::reset(uint32_t heap, uint32_t heap_break)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    flush_console();
+    for (std::size_t fd = 3; fd < files.size(); fd++)
+    {
+        if (files[fd] >= 0)
+            ::close(files[fd]);
+    }
+    files = { 0, 1, 2 };
+    heap_start = heap;
+    heap_end = std::max(heap, heap_break);
+    status = 0;
+}
+
+void syscall_proxy::flush()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    flush_console();
+}
+
+// Called with the lock held. Anything brv itself printed comes out first.
+void syscall_proxy::flush_console()
+{
+    if (console.empty())
+        return;
+    std::fflush(stdout);
+    write_all(1, console.data(), console.size());
+    console.clear();
+}
+
+int syscall_proxy::host_fd(uint32_t fd) const
+{
+    return fd < files.size() ? files[fd] : -1;
+}
+
+bool syscall_proxy::in_memory(uint32_t addr, uint32_t len) const
+{
+    return (uint64_t)addr + len <= memory.size();
+}
+
+// Every call that writes guest memory goes through here. Like the hart's own
+// stores, other harts see new code after FENCE.I.
+void syscall_proxy::wrote(hart& h, uint32_t addr, uint32_t len)
+{
+    if (len > 0)
+        h.invalidate(addr, len);
+    last_addr = addr;
+    last_len = len;
+}
+
+void syscall_proxy::copy_out(hart& h, uint32_t addr, const void* data, uint32_t len)
+{
+    std::memcpy(memory.data() + addr, data, len);
+    wrote(h, addr, len);
+}
+
+int32_t syscall_proxy::open_file(uint32_t dir_fd, uint32_t path, uint32_t flags, uint32_t mode)
+{
+    int host_dir = (int32_t)dir_fd == GUEST_AT_FDCWD ? AT_FDCWD : host_fd(dir_fd);
+    if (host_dir == -1)
+        return -EBADF;
+
+    // The path has to end inside guest memory
+    if (!in_memory(path, 1))
+        return -EFAULT;
+    const char* name = (const char*)memory.data() + path;
+    if (strnlen(name, memory.size() - path) == memory.size() - path)
+        return -EFAULT;
+
+    int fd = openat(host_dir, name, host_open_flags(flags), mode);
+    if (fd < 0)
+        return -errno;
+
+    for (std::size_t i = 3; i < files.size(); i++)
+    {
+        if (files[i] < 0)
+        {
+            files[i] = fd;
+            return i;
+        }
+    }
+    files.push_back(fd);
+    return files.size() - 1;
+}
+
+int32_t syscall_proxy::close_file(uint32_t fd)
+{
+    int host = host_fd(fd);
+    if (host < 0)
+        return -EBADF;
+    // The console stays open for brv, the guest just loses it
+    if (fd > 2 && ::close(host) != 0)
+        return -errno;
+    files[fd] = -1;
+    return 0;
+}
+
+// read and write may block on the host for as long as they like, so other
+// harts' calls go ahead meanwhile. The host fd is looked up before letting
+// go, the same as a kernel racing a close on another thread.
+int32_t syscall_proxy::read_file(hart& h, std::unique_lock<std::mutex>& guard, uint32_t fd, uint32_t addr, uint32_t len)
+{
+    int host = host_fd(fd);
+    if (host < 0)
+        return -EBADF;
+    if (!in_memory(addr, len))
+        return -EFAULT;
+
+    // Show any prompt before waiting for input
+    if (host == 0)
+        flush_console();
+
+    guard.unlock();
+    ssize_t got = ::read(host, memory.data() + addr, len);
+    int error = errno;
+    guard.lock();
+    if (got < 0)
+        return -error;
+    wrote(h, addr, got);
+    return got;
+}
+
+int32_t syscall_proxy::write_file(std::unique_lock<std::mutex>& guard, uint32_t fd, uint32_t addr, uint32_t len)
+{
+    int host = host_fd(fd);
+    if (host < 0)
+        return -EBADF;
+    if (!in_memory(addr, len))
+        return -EFAULT;
+
+    // Only the console is open, and nothing sent to it leaves the machine
+    if (!host_access)
+        return len;
+
+    const char* data = (const char*)memory.data() + addr;
+    if (host == 1 && len < DIRECT_WRITE)
+    {
+        console.insert(console.end(), data, data + len);
+        if (console.size() >= CONSOLE_BUFFER)
+            flush_console();
+        return len;
+    }
+
+    // Keep the order of everything already printed to the console
+    if (host <= 2)
+        flush_console();
+    guard.unlock();
+    ssize_t done = ::write(host, data, len);
+    int error = errno;
+    guard.lock();
+    return done < 0 ? -error : done;
+}
+
+int32_t syscall_proxy::seek_file(uint32_t fd, int32_t offset, uint32_t whence)
+{
+    int host = host_fd(fd);
+    if (host < 0)
+        return -EBADF;
+    off_t at = ::lseek(host, offset, whence);
+    if (at < 0)
+        return -errno;
+    return at > INT32_MAX ? -EOVERFLOW : at;
+}
+
+// Fills in struct kernel_stat as libgloss lays it out for RV32
+int32_t syscall_proxy::stat_file(hart& h, uint32_t fd, uint32_t addr)
+{
+    int host = host_fd(fd);
+    if (host < 0)
+        return -EBADF;
+    if (!in_memory(addr, 128))
+        return -EFAULT;
+
+    struct stat st;
+    if (::fstat(host, &st) != 0)
+        return -errno;
+
+    uint8_t out[128] = { 0 };
+    auto put32 = [&](uint32_t at, uint32_t v) { std::memcpy(out + at, &v, 4); };
+    auto put64 = [&](uint32_t at, uint64_t v) { std::memcpy(out + at, &v, 8); };
+    put64(0, st.st_dev);
+    put64(8, st.st_ino);
+    put32(16, st.st_mode);
+    put32(20, st.st_nlink);
+    put32(24, st.st_uid);
+    put32(28, st.st_gid);
+    put64(32, st.st_rdev);
+    put64(48, st.st_size);
+    put32(56, st.st_blksize);
+    put64(64, st.st_blocks);
+    put64(72, st.st_atim.tv_sec);
+    put32(80, st.st_atim.tv_nsec);
+    put64(88, st.st_mtim.tv_sec);
+    put32(96, st.st_mtim.tv_nsec);
+    put64(104, st.st_ctim.tv_sec);
+    put32(112, st.st_ctim.tv_nsec);
+    copy_out(h, addr, out, sizeof(out));
+    return 0;
+}
+
+// RV32 only has the 64-bit time ABI: tv_sec and tv_nsec are both 8 bytes,
+// which newlib's struct timespec (8 byte tv_sec, padded 4 byte tv_nsec)
+// reads the same way
+int32_t syscall_proxy::clock_time(hart& h, uint32_t clock, uint32_t addr)
+{
+    if (!in_memory(addr, 16))
+        return -EFAULT;
+
+    struct timespec ts;
+    if (clock_gettime(clock, &ts) != 0)
+        return -errno;
+
+    int64_t out[2] = { ts.tv_sec, ts.tv_nsec };
+    copy_out(h, addr, out, sizeof(out));
+    return 0;
+}
+
+// Guest memory is all there already, the break only moves. Returns the new
+// break, or the old one when asked for something out of range.
+uint32_t syscall_proxy::set_break(uint32_t addr)
+{
+    if (addr >= heap_start && addr < memory.size())
+        heap_end = addr;
+    return heap_end;
+}
@@ -0,0 +1,85 @@
+#ifndef SYSCALL_HPP
+#define SYSCALL_HPP
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "memory.hpp"
+
+class hart;
+
+// Linux-style system calls made with ECALL, the way newlib's libgloss issues
+// them: the call number in a7, arguments in a0-a5 and the result, or -errno,
+// back in a0. Guest file descriptors index a table of host ones, so a guest
+// can only reach the console and the files it opened itself.
+//
+// Console output is collected and written out in batches. Writes of a page
+// or more, and everything sent to other files, go to the host straight from
+// guest memory, as do reads. One proxy serves every hart of a machine.
+class syscall_proxy
+{
+public:
+    explicit syscall_proxy(guest_memory& memory);
+    ~syscall_proxy();
+
+    syscall_proxy(const syscall_proxy&) = delete;
+    syscall_proxy& operator=(const syscall_proxy&) = delete;
+
+    // Carry out the call h has just made with ECALL. Returns false if it was
+    // exit, h is done.
+    bool handle(hart& h);
+
+    // Close the guest's files and start its heap over at heap_start, with
+    // the break at heap_break if that's further on
+    void reset(uint32_t heap_start, uint32_t heap_break = 0);
+
+    uint32_t heap_base() const { return heap_start; }
+    uint32_t heap_break() const { return heap_end; }
+
+    // Write out buffered console output
+    void flush();
+
+    // Without host access console writes are thrown away and every call
+    // but those, brk and exit fails with ENOSYS, for running code nobody
+    // has looked at, such as fuzzer input or batch jobs
+    void set_host_access(bool allowed) { host_access = allowed; }
+
+    // Status passed to the last exit call
+    int exit_code() const { return status; }
+
+    // Guest memory the last call wrote, [addr, addr + len). Lets another
+    // machine running the same program take its results over rather than
+    // making the call again.
+    uint32_t written_addr() const { return last_addr; }
+    uint32_t written_len() const { return last_len; }
+
+private:
+    int32_t open_file(uint32_t dir_fd, uint32_t path, uint32_t flags, uint32_t mode);
+    int32_t close_file(uint32_t fd);
+    int32_t read_file(hart& h, std::unique_lock<std::mutex>& guard, uint32_t fd, uint32_t addr, uint32_t len);
+    int32_t write_file(std::unique_lock<std::mutex>& guard, uint32_t fd, uint32_t addr, uint32_t len);
+    int32_t seek_file(uint32_t fd, int32_t offset, uint32_t whence);
+    int32_t stat_file(hart& h, uint32_t fd, uint32_t addr);
+    int32_t clock_time(hart& h, uint32_t clock, uint32_t addr);
+    uint32_t set_break(uint32_t addr);
+
+    int host_fd(uint32_t fd) const;
+    bool in_memory(uint32_t addr, uint32_t len) const;
+    void wrote(hart& h, uint32_t addr, uint32_t len);
+    void copy_out(hart& h, uint32_t addr, const void* data, uint32_t len);
+    void flush_console();
+
+    guest_memory& memory;
+    std::mutex lock;
+    std::vector<int> files;     // Host fd for each guest fd, -1 if closed
+    std::vector<char> console;  // Pending output to host stdout
+    uint32_t heap_start = 0;
+    uint32_t heap_end = 0;
+    int status = 0;
+    bool host_access = true;
+    uint32_t last_addr = 0;
+    uint32_t last_len = 0;
+};
+
+#endif
@@ -0,0 +1,270 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <fmt/core.h>
+
+#include "trace.hpp"
+#include "decode.hpp"
+
+const char TRACE_MAGIC[8] = { 'B', 'R', 'V', 'T', 'R', 'A', 'C', 'E' };
+
+trace_context::trace_context()
+{
+    // pc 1 is never an instruction, so every slot starts out empty
+    std::fill(std::begin(slot_pc), std::end(slot_pc), 1);
+    std::fill(std::begin(slot_raw), std::end(slot_raw), 0);
+}
+
+// Size codes, see TRACE_SIZES
+static uint32_t signed_size(uint32_t v)
+{
+    uint32_t magnitude = v ^ (uint32_t)((int32_t)v >> 31);
+    return (v != 0) + (magnitude >= 0x80) + (magnitude >= 0x8000);
+}
+
+static uint32_t unsigned_size(uint32_t v)
+{
+    return (v != 0) + (v >= 0x100) + (v >= 0x10000);
+}
+
+// Always stores 4 bytes, the output has room for the extra ones
+static uint8_t* put(uint8_t* p, uint32_t v, uint32_t code)
+{
+    std::memcpy(p, &v, 4);
+    return p + TRACE_SIZES[code];
+}
+
+trace_writer::~trace_writer()
+{
+    close();
+}
+
+bool trace_writer::open(const char* path, uint32_t hart_id)
+{
+    close();
+    file = std::fopen(path, "wb");
+    if (!file)
+        return false;
+
+    uint32_t header[2] = { TRACE_VERSION, hart_id };
+    if (std::fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC), 1, file) != 1 || std::fwrite(header, sizeof(header), 1, file) != 1)
+    {
+        std::fclose(file);
+        file = nullptr;
+        return false;
+    }
+
+    ctx = trace_context();
+    std::copy(std::begin(ctx.slot_pc), std::end(ctx.slot_pc), slot_pc);
+    buffers[0].resize(CHUNK_RECORDS);
+    buffers[1].resize(CHUNK_RECORDS);
+    // At most a tag and five 4 byte fields a record, and the spare bytes put stores
+    encoded.resize(CHUNK_RECORDS * 22 + 4);
+    active = 0;
+    chunk = buffers[0].data();
+    fill = 0;
+    pending = 0;
+    done = false;
+    failed = false;
+
+    writer = std::thread([this]()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;)
+        {
+            changed.wait(guard, [this]() { return pending != 0 || done; });
+            if (pending == 0)
+                return;
+            // The hart doesn't touch the other chunk until pending is back to 0
+            const trace_record* records = buffers[active ^ 1].data();
+            uint32_t n = pending;
+            guard.unlock();
+            uint32_t len = encode(records, n, encoded.data());
+            bool ok = std::fwrite(encoded.data(), 1, len, file) == len;
+            guard.lock();
+            failed |= !ok;
+            pending = 0;
+            changed.notify_all();
+        }
+    });
+    return true;
+}
+
+uint32_t trace_writer::encode(const trace_record* records, uint32_t n, uint8_t* out)
+{
+    uint8_t* p = out;
+    uint32_t next_pc = ctx.next_pc, mem_addr = ctx.mem_addr;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        const trace_record& r = records[i];
+        uint8_t* const start = p;
+        p += 2;
+        uint32_t tag = r.rd;
+
+        uint32_t jump = r.pc - next_pc;
+        uint32_t code = signed_size(jump);
+        tag |= code << TRACE_JUMP_SHIFT;
+        p = put(p, jump, code);
+
+        if (r.with_raw)
+        {
+            tag |= TRACE_RAW;
+            std::memcpy(p, &r.raw, 4);
+            p += r.len;
+        }
+
+        // x0 is always 0, so it costs nothing when there's no rd
+        uint32_t delta = r.rd_value - ctx.regs[r.rd];
+        code = signed_size(delta);
+        tag |= code << TRACE_RD_SHIFT;
+        p = put(p, delta, code);
+        ctx.regs[r.rd] = r.rd_value;
+
+        if (r.mem)
+        {
+            tag |= TRACE_MEM;
+            delta = r.mem_addr - mem_addr;
+            code = signed_size(delta);
+            tag |= code << TRACE_ADDR_SHIFT;
+            p = put(p, delta, code);
+            code = unsigned_size(r.mem_value);
+            tag |= code << TRACE_VALUE_SHIFT;
+            p = put(p, r.mem_value, code);
+            mem_addr = r.mem_addr;
+        }
+
+        uint16_t tag16 = tag;
+        std::memcpy(start, &tag16, 2);
+        next_pc = r.pc + r.len;
+    }
+    ctx.next_pc = next_pc;
+    ctx.mem_addr = mem_addr;
+    return p - out;
+}
+
+void trace_writer::flip()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [this]() { return pending == 0; });
+    pending = fill;
+    active ^= 1;
+    chunk = buffers[active].data();
+    fill = 0;
+    changed.notify_all();
+}
+
+bool trace_writer::close()
+{
+    if (!file)
+        return true;
+
+    if (fill > 0)
+        flip();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        done = true;
+        changed.notify_all();
+    }
+    writer.join();
+
+    bool ok = !failed && std::fclose(file) == 0;
+    file = nullptr;
+    return ok;
+}
+
+trace_reader::~trace_reader()
+{
+    if (file)
+        std::fclose(file);
+}
+
+bool trace_reader::open(const char* path)
+{
+    file = std::fopen(path, "rb");
+    if (!file)
+    {
+        fmt::print("File does not exist or could not be opened\n");
+        return false;
+    }
+
+    char magic[8];
+    uint32_t header[2];
+    if (std::fread(magic, sizeof(magic), 1, file) != 1 || std::memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+        std::fread(header, sizeof(header), 1, file) != 1)
+    {
+        fmt::print("Not a brv trace\n");
+        return false;
+    }
+    if (header[0] != TRACE_VERSION)
+    {
+        fmt::print("Trace is version {}, expected {}\n", header[0], TRACE_VERSION);
+        return false;
+    }
+    hart = header[1];
+    return true;
+}
+
+bool trace_reader::get(uint32_t code, bool is_signed, uint32_t& v)
+{
+    uint8_t bytes[4] = { 0 };
+    uint32_t len = TRACE_SIZES[code];
+    if (len > 0 && std::fread(bytes, len, 1, file) != 1)
+        return false;
+    v = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+    if (is_signed && len > 0 && len < 4)
+        v = sign_extend(v, 32 - len * 8);
+    return true;
+}
+
+bool trace_reader::next(trace_entry& e)
+{
+    uint8_t tag_bytes[2];
+    if (std::fread(tag_bytes, 2, 1, file) != 1)
+        return false;
+    uint32_t tag = tag_bytes[0] | tag_bytes[1] << 8;
+
+    uint32_t jump;
+    if (!get((tag >> TRACE_JUMP_SHIFT) & 3, true, jump))
+        return false;
+    e.pc = ctx.next_pc + jump;
+
+    uint32_t slot = (e.pc >> 1) & (TRACE_SLOTS - 1);
+    if (tag & TRACE_RAW)
+    {
+        uint8_t bytes[4] = { 0 };
+        if (std::fread(bytes, 2, 1, file) != 1)
+            return false;
+        if ((bytes[0] & 3) == 3 && std::fread(bytes + 2, 2, 1, file) != 1)
+            return false;
+        ctx.slot_pc[slot] = e.pc;
+        ctx.slot_raw[slot] = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+    }
+    else if (ctx.slot_pc[slot] != e.pc)
+    {
+        return false;
+    }
+    e.raw = ctx.slot_raw[slot];
+
+    uint32_t delta;
+    e.rd = tag & 31;
+    if (!get((tag >> TRACE_RD_SHIFT) & 3, true, delta))
+        return false;
+    if (e.rd)
+        ctx.regs[e.rd] += delta;
+    e.rd_value = ctx.regs[e.rd];
+
+    e.mem = tag & TRACE_MEM;
+    e.mem_addr = e.mem_value = 0;
+    if (e.mem)
+    {
+        if (!get((tag >> TRACE_ADDR_SHIFT) & 3, true, delta) || !get((tag >> TRACE_VALUE_SHIFT) & 3, false, e.mem_value))
+            return false;
+        ctx.mem_addr += delta;
+        e.mem_addr = ctx.mem_addr;
+    }
+
+    ctx.next_pc = e.pc + ((e.raw & 3) == 3 ? 4 : 2);
+    return true;
+}
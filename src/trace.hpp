@@ -0,0 +1,170 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Binary execution trace of one hart, a record per retired instruction.
+// After a 16 byte header ("BRVTRACE", version, hart id) each record is a
+// u16 tag and then whichever of these fields it has, in this order:
+//
+//   jump    pc minus the previous instruction's fall-through, if it isn't that
+//   raw     if TRACE_RAW: the instruction, 2 or 4 bytes as its low bits say.
+//           Only sent when its pc-indexed slot last held another pc, or the
+//           hart decoded the code there again since.
+//   rd      the value written back minus the last one traced for that rd
+//   addr    for TRACE_MEM, the address minus the previous access's
+//   value   for TRACE_MEM, the value stored, or loaded into rd
+//
+// Bits 0-4 of the tag are the rd written back (0 for none). The other
+// fields are varints whose length is a 2 bit size code in the tag: none,
+// 1, 2 or 4 little endian bytes, sign-extended except for value. Writing
+// them is a fixed-size store and a table lookup, no loop over bytes.
+//
+// Both ends rebuild that context as they go, starting from all zeroes, so
+// a straight-line run of cached code costs a few bytes a record.
+enum trace_tag : uint16_t
+{
+    TRACE_RD_SHIFT = 5,
+    TRACE_JUMP_SHIFT = 7,
+    TRACE_ADDR_SHIFT = 9,
+    TRACE_VALUE_SHIFT = 11,
+    TRACE_RAW = 1 << 13,
+    TRACE_MEM = 1 << 14
+};
+
+const uint32_t TRACE_VERSION = 1;
+const uint32_t TRACE_SLOTS = 4096;
+const uint8_t TRACE_SIZES[4] = { 0, 1, 2, 4 };
+
+// What a record is encoded against
+struct trace_context
+{
+    uint32_t next_pc = 0;
+    uint32_t mem_addr = 0;
+    uint32_t regs[32] = { 0 };
+    uint32_t slot_pc[TRACE_SLOTS];
+    uint32_t slot_raw[TRACE_SLOTS];
+
+    trace_context();
+};
+
+struct trace_entry
+{
+    uint32_t pc;
+    uint32_t raw;
+    uint32_t rd;          // 0 if nothing was written back
+    uint32_t rd_value;
+    bool mem;
+    uint32_t mem_addr;
+    uint32_t mem_value;
+};
+
+// A retired instruction as the hart hands it over, before encoding
+struct trace_record
+{
+    uint32_t pc;
+    uint32_t raw;         // Only meaningful if with_raw
+    uint32_t rd_value;
+    uint32_t mem_addr;
+    uint32_t mem_value;
+    uint8_t len;
+    uint8_t rd;
+    bool with_raw;
+    bool mem;
+};
+
+// The hart fills one of two chunks of plain records while a background
+// thread encodes and writes out the other, so all the hart pays per
+// instruction is a few stores. It only waits when it fills a chunk before
+// the writer is done with the previous one.
+class trace_writer
+{
+public:
+    trace_writer() = default;
+    ~trace_writer();
+
+    trace_writer(const trace_writer&) = delete;
+    trace_writer& operator=(const trace_writer&) = delete;
+
+    // Start a trace of hart_id in a new file at path
+    bool open(const char* path, uint32_t hart_id);
+
+    // Write out everything recorded. Returns false if any of it failed.
+    bool close();
+
+    // True if pc's slot already holds pc, so its record can leave out the
+    // instruction unless the hart decoded it again
+    bool knows(uint32_t pc) const
+    {
+        return slot_pc[(pc >> 1) & (TRACE_SLOTS - 1)] == pc;
+    }
+
+    // Record a retired instruction len bytes long, raw is only used if
+    // with_raw. rd_value has to be 0 when rd is.
+    void record(uint32_t pc, uint32_t len, bool with_raw, uint32_t raw, uint32_t rd, uint32_t rd_value, bool mem, uint32_t mem_addr, uint32_t mem_value)
+    {
+        if (with_raw)
+            slot_pc[(pc >> 1) & (TRACE_SLOTS - 1)] = pc;
+        chunk[fill] = { pc, raw, rd_value, mem_addr, mem_value, (uint8_t)len, (uint8_t)rd, with_raw, mem };
+        if (++fill == CHUNK_RECORDS) [[unlikely]]
+            flip();
+    }
+
+private:
+    static const uint32_t CHUNK_RECORDS = 1 << 12;
+
+    // Hand the full chunk to the writer thread and carry on in the other
+    void flip();
+
+    // Encode n records into out, returns the bytes written
+    uint32_t encode(const trace_record* records, uint32_t n, uint8_t* out);
+
+    uint32_t slot_pc[TRACE_SLOTS];   // The hart's copy, to leave out raw
+    trace_context ctx;               // The writer thread's
+    std::vector<trace_record> buffers[2];
+    std::vector<uint8_t> encoded;
+    trace_record* chunk = nullptr;
+    uint32_t fill = 0;
+    uint32_t active = 0;
+
+    std::FILE* file = nullptr;
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable changed;
+    uint32_t pending = 0;   // Records of the other chunk still to be written
+    bool done = false;
+    bool failed = false;
+};
+
+// Reads a trace back one record at a time
+class trace_reader
+{
+public:
+    trace_reader() = default;
+    ~trace_reader();
+
+    trace_reader(const trace_reader&) = delete;
+    trace_reader& operator=(const trace_reader&) = delete;
+
+    // Prints the reason and returns false if path isn't a trace
+    bool open(const char* path);
+
+    // False at the end of the trace, or where it was cut off
+    bool next(trace_entry& e);
+
+    uint32_t hart_id() const { return hart; }
+
+private:
+    bool get(uint32_t code, bool is_signed, uint32_t& v);
+
+    trace_context ctx;
+    std::FILE* file = nullptr;
+    uint32_t hart = 0;
+};
+
+#endif
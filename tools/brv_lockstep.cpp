@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "machine.hpp"
+#include "decode.hpp"
+#include "csr.hpp"
+#include "rv32_instr_pp_decode.hpp"
+
+// brv-lockstep: runs a program on the reference switch core and on a faster
+// one side by side, a basic block at a time, and checks both end every block
+// with the same pc, registers and bytes at the addresses the block stored
+// to. At the first difference it stops and prints the instructions leading
+// up to it.
+//
+//   brv-lockstep [--core=block|threaded|switch] [--abi] [--limit=N] [--context=N] FILE
+//
+// System calls and time CSR reads are only carried out by the reference,
+// the other core takes their results over. Exits with 1 if the cores
+// diverged.
+
+// Blocks are cut here even without a branch, as the block core cuts them
+const uint32_t LOCKSTEP_BLOCK = 64;
+
+struct retired_instr
+{
+    uint32_t pc;
+    uint32_t raw;
+};
+
+struct store_range
+{
+    uint32_t addr;
+    uint32_t len;
+};
+
+static const char* stop_name(exit_reason reason)
+{
+    switch (reason)
+    {
+        case EXIT_EBREAK:      return "EBREAK";
+        case EXIT_FAULT:       return "a fault";
+        case EXIT_LIMIT:       return "nothing";
+        case EXIT_EXITED:      return "exit";
+        case EXIT_INTERRUPTED: return "an interrupt";
+        default:               return "ECALL";
+    }
+}
+
+static uint32_t fetch(machine& vm, uint32_t pc)
+{
+    uint16_t low = 0, high = 0;
+    if (vm.read(pc, &low, 2) && (low & 3) == 3)
+        vm.read(pc + 2, &high, 2);
+    return low | (uint32_t)high << 16;
+}
+
+static bool ends_block(uint8_t op)
+{
+    return (op >= OP_BEQ && op <= OP_JALR) || op == OP_ECALL || op == OP_EBREAK || op == OP_FENCE_I;
+}
+
+// Its result comes from the host, not the program
+static bool from_host(const decoded_instr& d)
+{
+    bool csr = d.op >= OP_CSRRW && d.op <= OP_CSRRCI;
+    return d.op == OP_ECALL || (csr && (d.imm == CSR_TIME || d.imm == CSR_TIMEH));
+}
+
+static uint32_t store_len(uint8_t op)
+{
+    switch (op)
+    {
+        case OP_SB: return 1;
+        case OP_SH: return 2;
+        case OP_SW: return 4;
+        default:    return op >= OP_SC_W && op <= OP_AMOMAXU_W ? 4 : 0;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    std::string core_name = "block";
+    REG_TYPE reg_type = X_TYPE;
+    uint64_t limit = UINT64_MAX;
+    uint32_t context = 16;
+    const char* path = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.rfind("--core=", 0) == 0)
+            core_name = arg.substr(7);
+        else if (arg == "--abi")
+            reg_type = ABI_TYPE;
+        else if (arg.rfind("--limit=", 0) == 0)
+            limit = std::stoull(arg.substr(8));
+        else if (arg.rfind("--context=", 0) == 0)
+            context = std::max(1ul, std::stoul(arg.substr(10)));
+        else if (!path)
+            path = argv[i];
+    }
+    if (!path)
+    {
+        fmt::print("Usage: brv-lockstep [--core=block|threaded|switch] [--abi] [--limit=N] [--context=N] FILE\n");
+        return 1;
+    }
+
+    core_kind core;
+    if (core_name == "switch")
+        core = CORE_SWITCH;
+    else if (core_name == "threaded")
+        core = CORE_THREADED;
+    else if (core_name == "block")
+        core = CORE_BLOCK;
+    else
+    {
+        fmt::print("Unknown core '{}', expected 'switch', 'threaded' or 'block'\n", core_name);
+        return 1;
+    }
+
+    machine ref(1ull << 32, CORE_SWITCH, 1);
+    machine test(1ull << 32, core, 1);
+    if (!ref.load(path) || !test.load(path))
+        return 1;
+    hart& r = ref.hart_at(0);
+    hart& t = test.hart_at(0);
+
+    // The last context instructions the reference retired, oldest first
+    // from history[seen % context]
+    std::vector<retired_instr> history(context);
+    uint64_t seen = 0;
+    std::vector<store_range> stores;
+    uint64_t blocks = 0;
+
+    for (;;)
+    {
+        // Step the reference through a block. Anything from the host is a
+        // block on its own.
+        stores.clear();
+        uint32_t n = 0;
+        bool host = false;
+        decoded_instr d;
+        exit_reason ref_reason = EXIT_LIMIT;
+        while (ref_reason == EXIT_LIMIT && n < LOCKSTEP_BLOCK && r.instret() < limit)
+        {
+            uint32_t raw = fetch(ref, r.pc());
+            d = (raw & 3) == 3 ? decode_instr(raw) : decode_compressed(raw);
+            if (from_host(d) && n > 0)
+                break;
+            history[seen++ % context] = { r.pc(), raw };
+            if (uint32_t len = store_len(d.op))
+                stores.push_back({ r.reg(d.rs1) + (d.op <= OP_SW ? d.imm : 0), len });
+            ref_reason = r.step();
+            n++;
+            host = from_host(d);
+            if (host || ends_block(d.op))
+                break;
+        }
+        if (n == 0)
+        {
+            fmt::print("{} instructions in {} blocks matched, stopped at the limit\n", r.instret(), blocks);
+            return 0;
+        }
+
+        exit_reason test_reason;
+        if (host)
+        {
+            // A system call's only effects are a0 and what it wrote to memory
+            cpu_state& tc = t.state();
+            tc.pc_reg = r.pc();
+            tc.instret++;
+            uint32_t rd = d.op == OP_ECALL ? 10 : d.rd;
+            t.set_reg(rd, r.reg(rd));
+            if (d.op == OP_ECALL)
+            {
+                std::vector<uint8_t> written(ref.syscalls().written_len());
+                ref.read(ref.syscalls().written_addr(), written.data(), written.size());
+                test.write(ref.syscalls().written_addr(), written.data(), written.size());
+            }
+            test_reason = ref_reason;
+        }
+        else
+        {
+            test_reason = t.run(n);
+        }
+        blocks++;
+
+        std::vector<std::string> diffs;
+        if (test_reason != ref_reason)
+            diffs.push_back(fmt::format("reference stopped with {}, {} with {}", stop_name(ref_reason), core_name, stop_name(test_reason)));
+        if (t.pc() != r.pc())
+            diffs.push_back(fmt::format("pc: reference {:08x}, {} {:08x}", r.pc(), core_name, t.pc()));
+        if (t.instret() != r.instret())
+            diffs.push_back(fmt::format("instret: reference {}, {} {}", r.instret(), core_name, t.instret()));
+        for (uint32_t i = 1; i < 32; i++)
+        {
+            if (t.reg(i) != r.reg(i))
+                diffs.push_back(fmt::format("{}: reference {:08x}, {} {:08x}", reg_name(i, reg_type), r.reg(i), core_name, t.reg(i)));
+        }
+        if (ref_reason == EXIT_FAULT && t.state().fault_addr != r.state().fault_addr)
+            diffs.push_back(fmt::format("fault address: reference {:08x}, {} {:08x}", r.state().fault_addr, core_name, t.state().fault_addr));
+        for (const store_range& s : stores)
+        {
+            uint32_t want = 0, got = 0;
+            ref.read(s.addr, &want, s.len);
+            test.read(s.addr, &got, s.len);
+            if (want != got)
+                diffs.push_back(fmt::format("memory at {:08x}: reference {:0{}x}, {} {:0{}x}", s.addr, want, s.len * 2, core_name, got, s.len * 2));
+        }
+
+        if (!diffs.empty())
+        {
+            fmt::print("Diverged in block {} ({} instructions in), {} core against the reference:\n\n", blocks, r.instret(), core_name);
+            // The block that diverged is marked
+            for (uint64_t i = seen - std::min<uint64_t>(seen, context); i < seen; i++)
+            {
+                const retired_instr& e = history[i % context];
+                bool compressed = (e.raw & 3) != 3;
+                fmt::print("{} {:08x}  {:>8}  ", i >= seen - n ? '>' : ' ', e.pc,
+                           compressed ? fmt::format("{:04x}", e.raw) : fmt::format("{:08x}", e.raw));
+                rv_disassemble(e.raw, reg_type);
+            }
+            fmt::print("\n");
+            for (const std::string& diff : diffs)
+                fmt::print("{}\n", diff);
+            return 1;
+        }
+
+        if (ref_reason != EXIT_LIMIT)
+        {
+            fmt::print("{} instructions in {} blocks matched, both stopped with {}\n", r.instret(), blocks, stop_name(ref_reason));
+            return 0;
+        }
+    }
+}
@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/core.h>
+#include <nlohmann/json.hpp>
+
+#include "machine.hpp"
+
+// brv-test: runs every assembly test in-process and checks the registers it
+// stops with against its correct.json. Each test is the linked.bin that
+// assembly_testing/test.py builds next to the test.s.
+//
+//   brv-test [--core=block|threaded|switch] [--threads=N] [DIR]
+//
+// DIR defaults to assembly_testing. Exits with 1 if any test failed.
+
+// Guards against a test that never reaches its EBREAK
+const uint64_t TEST_BUDGET = 10000000;
+
+struct test_case
+{
+    std::filesystem::path dir;
+    std::string name;
+    uint32_t regs[32];
+    uint32_t pc;
+    bool has_expected = false;
+
+    // Filled in by whichever worker runs it
+    bool passed = false;
+    std::string failure;
+    double millis = 0;
+};
+
+// correct.json holds "x0".."x31" and "PCR" as decimal strings, registers
+// signed as spit_registers_json prints them
+static bool read_expected(test_case& t)
+{
+    std::ifstream in(t.dir / "correct.json");
+    nlohmann::json json = nlohmann::json::parse(in, nullptr, false);
+    if (json.is_discarded() || !json.is_object())
+        return false;
+    try
+    {
+        for (uint32_t i = 0; i < 32; i++)
+            t.regs[i] = std::stoll(json.at("x" + std::to_string(i)).get<std::string>());
+        t.pc = std::stoll(json.at("PCR").get<std::string>());
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+    return true;
+}
+
+// vm is the worker's own machine, cleared by the caller if it ran a test before
+static void run_test(test_case& t, machine& vm)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::filesystem::path image = t.dir / "linked.bin";
+    if (!t.has_expected)
+        t.failure = "correct.json is not a register file";
+    else if (!std::filesystem::exists(image))
+        t.failure = "no linked.bin, build it with test.py";
+    else if (std::string error; !vm.load(image.c_str(), error))
+        t.failure = "could not load linked.bin: " + error;
+    else
+    {
+        exit_reason reason = vm.run(TEST_BUDGET)[0];
+        const hart& h = vm.hart_at(0);
+        if (reason != EXIT_EBREAK)
+            t.failure = reason == EXIT_LIMIT ? fmt::format("still running after {} instructions", TEST_BUDGET)
+                                             : fmt::format("stopped at pc {:08x} without reaching EBREAK", h.pc());
+        for (uint32_t i = 0; i < 32 && t.failure.empty(); i++)
+        {
+            if (h.reg(i) != t.regs[i])
+                t.failure = fmt::format("x{} is {}, expected {}", i, (int32_t)h.reg(i), (int32_t)t.regs[i]);
+        }
+        if (t.failure.empty() && h.pc() != t.pc)
+            t.failure = fmt::format("PCR is {}, expected {}", h.pc(), t.pc);
+    }
+    t.passed = t.failure.empty();
+    t.millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[])
+{
+    std::string core_name = "block";
+    uint32_t thread_count = std::max(1u, std::thread::hardware_concurrency());
+    std::filesystem::path root = "assembly_testing";
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.rfind("--core=", 0) == 0)
+            core_name = arg.substr(7);
+        else if (arg.rfind("--threads=", 0) == 0)
+            thread_count = std::max(1ul, std::stoul(arg.substr(10)));
+        else
+            root = arg;
+    }
+
+    core_kind core;
+    if (core_name == "switch")
+        core = CORE_SWITCH;
+    else if (core_name == "threaded")
+        core = CORE_THREADED;
+    else if (core_name == "block")
+        core = CORE_BLOCK;
+    else
+    {
+        fmt::print("Unknown core '{}', expected 'switch', 'threaded' or 'block'\n", core_name);
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::error_code error;
+    std::vector<test_case> tests;
+    for (auto it = std::filesystem::recursive_directory_iterator(root, error); !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error))
+    {
+        if (it->path().filename() != "correct.json")
+            continue;
+        test_case t;
+        t.dir = it->path().parent_path();
+        t.name = std::filesystem::relative(t.dir, root).string();
+        t.has_expected = read_expected(t);
+        tests.push_back(std::move(t));
+    }
+    if (error || tests.empty())
+    {
+        fmt::print("No tests found under {}\n", root.string());
+        return 1;
+    }
+    std::sort(tests.begin(), tests.end(), [](const test_case& a, const test_case& b) { return a.name < b.name; });
+
+    // Workers take the next test as they finish one, so a slow test never
+    // holds up the ones queued behind it. That's all the balancing a work
+    // stealing pool would do here: the tests are known up front and none
+    // spawns more, so one shared index stands in for per-worker queues.
+    // Like batch mode, each worker keeps one machine and clears it between
+    // tests.
+    std::atomic<std::size_t> next = 0;
+    auto worker = [&]()
+    {
+        machine vm(1ull << 32, core, 1);
+        bool dirty = false;
+        for (std::size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < tests.size();)
+        {
+            if (dirty)
+                vm.clear();
+            dirty = true;
+            run_test(tests[i], vm);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (uint32_t i = 1; i < std::min<std::size_t>(thread_count, tests.size()); i++)
+        workers.emplace_back(worker);
+    worker();
+    for (std::thread& w : workers)
+        w.join();
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    uint32_t failed = 0;
+    for (const test_case& t : tests)
+    {
+        if (t.passed)
+            fmt::print("PASS  {:<32} {:8.2f} ms\n", t.name, t.millis);
+        else
+        {
+            fmt::print("FAIL  {:<32} {:8.2f} ms  {}\n", t.name, t.millis, t.failure);
+            failed++;
+        }
+    }
+    fmt::print("{} passed, {} failed in {:.2f} ms on {} threads\n", tests.size() - failed, failed, elapsed.count(),
+               std::min<std::size_t>(thread_count, tests.size()));
+    return failed ? 1 : 0;
+}
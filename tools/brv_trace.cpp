@@ -0,0 +1,57 @@
+#include <cstdint>
+#include <string>
+
+#include <fmt/core.h>
+
+#include "trace.hpp"
+#include "rv32_instr_pp_decode.hpp"
+
+// brv-trace: prints a binary trace written by brv --trace=FILE as text, a
+// line per instruction: its pc, the instruction, what it wrote to a
+// register or memory, and its disassembly.
+//
+//   brv-trace [--abi] [--limit=N] FILE
+
+int main(int argc, char* argv[])
+{
+    REG_TYPE reg_type = X_TYPE;
+    uint64_t limit = UINT64_MAX;
+    const char* path = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--abi")
+            reg_type = ABI_TYPE;
+        else if (arg.rfind("--limit=", 0) == 0)
+            limit = std::stoull(arg.substr(8));
+        else if (!path)
+            path = argv[i];
+    }
+    if (!path)
+    {
+        fmt::print("Usage: brv-trace [--abi] [--limit=N] FILE\n");
+        return 1;
+    }
+
+    trace_reader trace;
+    if (!trace.open(path))
+        return 1;
+    fmt::print("Hart {}\n", trace.hart_id());
+
+    trace_entry e;
+    uint64_t count = 0;
+    for (; count < limit && trace.next(e); count++)
+    {
+        bool compressed = (e.raw & 3) != 3;
+        std::string effects;
+        if (e.rd)
+            effects = fmt::format("{}={:08x}", reg_name(e.rd, reg_type), e.rd_value);
+        if (e.mem)
+            effects += fmt::format("{}[{:08x}]={:x}", effects.empty() ? "" : " ", e.mem_addr, e.mem_value);
+
+        fmt::print("{:08x}  {:>8}  {:<36}", e.pc, compressed ? fmt::format("{:04x}", e.raw) : fmt::format("{:08x}", e.raw), effects);
+        rv_disassemble(e.raw, reg_type);
+    }
+    fmt::print("{} instructions\n", count);
+    return 0;
+}